@@ -14,6 +14,7 @@
  * System headers
  */
 #include <sys/stat.h>
+#include <time.h>
 
 /*
  * PostgreSQL headers
@@ -23,6 +24,16 @@
 #include "common/logging.h"
 #include "fe_utils/cancel.h"
 #include "fe_utils/connect_utils.h"
+#include "fe_utils/parallel_slot.h"
+#include "catalog/pg_type_d.h"
+#include "pqexpbuffer.h"
+
+/*
+ * zlib header, if available
+ */
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 extern char *optarg;
 
@@ -30,14 +41,91 @@ extern char *optarg;
  * Defines
  */
 #define PGCSVSTAT_VERSION "1.4.0"
+#define PGCSVSTAT_GZ_BUFFER_SIZE 131072
+#define PGCSVSTAT_MAX_ROTATION_SIZE 1048576   /* in MB */
+#define PGCSVSTAT_PARQUET_MAGIC "PAR1"
+#define PGCSVSTAT_PARQUET_ROWGROUP_SIZE 65536
+#define PGCSVSTAT_PARQUET_SETUP "SET DateStyle TO ISO; SET client_encoding TO 'UTF8'"
+
+/* Parquet types, repetitions, encodings, codecs, and pages (see parquet.thrift) */
+#define PARQUET_BOOLEAN 0
+#define PARQUET_INT32 1
+#define PARQUET_INT64 2
+#define PARQUET_FLOAT 4
+#define PARQUET_DOUBLE 5
+#define PARQUET_BYTE_ARRAY 6
+#define PARQUET_OPTIONAL 1
+#define PARQUET_UTF8 0
+#define PARQUET_DECIMAL 5
+#define PARQUET_TIMESTAMP_MICROS 10
+#define PARQUET_PLAIN 0
+#define PARQUET_RLE 3
+#define PARQUET_DELTA_BINARY_PACKED 5
+#define PARQUET_RLE_DICTIONARY 8
+#define PARQUET_UNCOMPRESSED 0
+#define PARQUET_GZIP 2
+#define PARQUET_DATA_PAGE 0
+#define PARQUET_DICTIONARY_PAGE 2
+
+/* Thrift compact protocol types, used by the Parquet metadata */
+#define THRIFT_STOP 0
+#define THRIFT_TRUE 1
+#define THRIFT_FALSE 2
+#define THRIFT_BYTE 3
+#define THRIFT_I16 4
+#define THRIFT_I32 5
+#define THRIFT_I64 6
+#define THRIFT_DOUBLE 7
+#define THRIFT_BINARY 8
+#define THRIFT_LIST 9
+#define THRIFT_SET 10
+#define THRIFT_STRUCT 12
+
+/* output formats */
+typedef enum
+{
+  FORMAT_CSV = 0,
+  FORMAT_PARQUET
+} format_t;
+
+/* types of the columns of a Parquet file */
+typedef enum
+{
+  COLUMN_BOOLEAN = 0,
+  COLUMN_INT32,
+  COLUMN_INT64,
+  COLUMN_DECIMAL,
+  COLUMN_TIMESTAMP,
+  COLUMN_TIMESTAMPTZ,
+  COLUMN_FLOAT,
+  COLUMN_DOUBLE,
+  COLUMN_STRING
+} columntype_t;
+
+/* rotation period of the output files */
+typedef enum
+{
+  ROTATE_NONE = 0,
+  ROTATE_HOUR,
+  ROTATE_DAY
+} rotation_t;
 
 /* these are the opts structures for command line params */
 struct options
 {
   bool quiet;
   bool nodb;
+  bool alldb;
+  bool dedup_queries;
   char *directory;
 
+  format_t   format;
+  int        incremental;
+  int        compress_level;
+  rotation_t rotation_period;
+  long       rotation_size;
+  int        jobs;
+
   char *dbname;
   char *hostname;
   char *port;
@@ -47,15 +135,143 @@ struct options
   int  minor;
 };
 
+/* a column of a Parquet file */
+typedef struct
+{
+  columntype_t type;
+  int          precision;   /* of a decimal */
+  int          scale;       /* of a decimal */
+} parquetcolumn;
+
+/* output file, either plain or gzip-compressed, or a Parquet file */
+typedef struct
+{
+  char   filename[MAXPGPATH];
+  bool   empty;
+  FILE   *fd;
+#ifdef HAVE_LIBZ
+  gzFile gzfd;
+#endif
+
+  /* Parquet file: its columns, and the footer rewritten after each run */
+  parquetcolumn *columns;
+  PQExpBuffer   schema;       /* schema elements */
+  int           nschema;
+  PQExpBuffer   rowgroups;    /* row group elements */
+  int           nrowgroups;
+  int64         nrows;
+  off_t         offset;       /* end of the last row group */
+} outfile;
+
+/* dictionary of the distinct values of a string column */
+typedef struct
+{
+  int  nvalues;
+  int  size;
+  char **values;
+  int  *slots;
+} dictionary;
+
+/* Thrift compact protocol reader, for the footer of a Parquet file */
+typedef struct
+{
+  const unsigned char *p;
+  const unsigned char *end;
+} thriftreader;
+
+/* hash table of 64-bit keys and values */
+typedef struct
+{
+  int    nentries;
+  int    size;
+  uint64 *keys;
+  uint64 *values;
+  bool   *used;
+} hashtable;
+
+/* what to do with a result received on a parallel slot */
+typedef struct
+{
+  char       filename[MAXPGPATH];
+  char       statefilename[MAXPGPATH];
+  const char *keyname;
+} resultcontext;
+
+/* the queries of a database, sent at once on a parallel slot */
+typedef struct
+{
+  PQExpBuffer   query;
+  resultcontext *contexts;  /* one per query, in the same order */
+  int           ncontexts;
+  int           size;
+  int           next;       /* context of the next result */
+} querybatch;
+
 /* global variables */
-struct options *opts;
-PGconn         *conn;
+struct options    *opts;
+PGconn            *conn;
+time_t            run_time;
+ParallelSlotArray *slots = NULL;
+querybatch        *batch = NULL;
+char              *current_dbname = NULL;
+Oid               current_dboid = InvalidOid;
 
 /* function prototypes */
 static void help(const char *progname);
 void get_opts(int, char **);
 void *myalloc(size_t size);
 char *mystrdup(const char *str);
+void build_output_filename(char *dest, size_t size, const char *filename, bool plain);
+void rotate_output_file(const char *filename, bool force);
+outfile *outfile_open(const char *filename, PGresult *res, bool plain);
+void outfile_write(outfile *f, const char *str);
+void outfile_write_bytes(outfile *f, const char *data, size_t len);
+void outfile_close(outfile *f);
+void write_csv(outfile *f, PGresult *res, bool quiet);
+void append_varint(PQExpBuffer buf, uint64 value);
+void append_le(PQExpBuffer buf, uint64 value, int nbytes);
+void append_bitpacked(PQExpBuffer buf, const uint64 *values, int n, int padded, int width);
+void append_hybrid(PQExpBuffer buf, const uint64 *values, int n, int width);
+void append_delta_packed(PQExpBuffer buf, const int64 *values, int n, int bits);
+int  dictionary_add(dictionary *dict, char *value);
+void thrift_field(PQExpBuffer buf, int *lastid, int id, int type);
+void thrift_int(PQExpBuffer buf, int *lastid, int id, int type, int64 value);
+void thrift_string(PQExpBuffer buf, int *lastid, int id, const char *value);
+void thrift_list(PQExpBuffer buf, int *lastid, int id, int size, int elemtype);
+bool thrift_read_varint(thriftreader *r, uint64 *value);
+bool thrift_read_field(thriftreader *r, int *lastid, int *type);
+bool thrift_read_list(thriftreader *r, int *size, int *elemtype);
+bool thrift_skip(thriftreader *r, int type);
+bool thrift_copy_list(thriftreader *r, PQExpBuffer buf, int *size);
+bool parse_decimal(const char *str, int scale, int64 *result);
+bool parse_timestamp(const char *str, int64 *result);
+void parquet_column_type(Oid type, int32 typmod, parquetcolumn *column);
+void parquet_schema(outfile *f, PGresult *res);
+bool parquet_read_footer(outfile *f, off_t size);
+#ifdef HAVE_LIBZ
+void parquet_compress(PQExpBuffer dest, const char *data, size_t len);
+#endif
+void parquet_write_page(PQExpBuffer chunk, int pagetype, int encoding, int nvalues,
+                        PQExpBuffer body, int64 *uncompressed, int64 *compressed);
+void write_parquet_rowgroup(outfile *f, PGresult *res, int first, int nrows);
+void write_parquet(outfile *f, PGresult *res);
+bool hashtable_lookup(hashtable *h, uint64 key, uint64 *value);
+void hashtable_insert(hashtable *h, uint64 key, uint64 value);
+PGresult *sql_exec_query(const char *query);
+void write_result(outfile *f, PGresult *res, bool quiet);
+void sql_write_result(const char *filename, PGresult *res, bool quiet);
+uint64 row_fingerprint(PGresult *res, int row);
+int  load_incremental_state(const char *filename, hashtable *state, uint64 *outfileid);
+void save_incremental_state(const char *filename, int runs, uint64 outfileid,
+                            PGresult *res, int keycolumn);
+PGresult *filter_changed_rows(hashtable *state, PGresult *res, int keycolumn);
+void sql_write_incremental_result(const char *filename, const char *statefilename,
+                                  PGresult *res, const char *keyname);
+void free_batch(querybatch *b);
+bool dump_result_handler(PGresult *res, PGconn *conn, void *context);
+void sql_exec_parallel(const char *query, const char *filename, const char *keyname);
+void send_batch(void);
+void sql_exec_incremental(const char *query, const char *filename, const char *keyname);
 int  sql_exec(const char *sql, const char *filename, bool quiet);
 void sql_exec_dump_pgstatactivity(void);
 void sql_exec_dump_pgstatarchiver(void);
@@ -77,6 +293,8 @@ void sql_exec_dump_pgstatioallsequences(void);
 void sql_exec_dump_pgstatuserfunctions(void);
 void sql_exec_dump_pgclass_size(void);
 void sql_exec_dump_pgstatstatements(void);
+void load_query_dictionary(const char *filename, hashtable *known);
+void sql_exec_dump_pgstatstatements_queries(PGresult *res);
 void sql_exec_dump_xlog_stat(void);
 void sql_exec_dump_pgstatprogressanalyze(void);
 void sql_exec_dump_pgstatprogressbasebackup(void);
@@ -84,6 +302,8 @@ void sql_exec_dump_pgstatprogresscluster(void);
 void sql_exec_dump_pgstatprogresscopy(void);
 void sql_exec_dump_pgstatprogresscreateindex(void);
 void sql_exec_dump_pgstatprogressvacuum(void);
+void dump_database_stats(void);
+void dump_all_databases_stats(ConnParams *cparams, const char *progname);
 void fetch_version(void);
 bool check_superuser(void);
 bool backend_minimum_version(int major, int minor);
@@ -95,6 +315,7 @@ void
 get_opts(int argc, char **argv)
 {
   int        c;
+  char       *end;
   const char *progname;
 
   progname = get_progname(argv[0]);
@@ -102,7 +323,15 @@ get_opts(int argc, char **argv)
   /* set the defaults */
   opts->quiet = false;
   opts->nodb = false;
+  opts->alldb = false;
+  opts->dedup_queries = false;
   opts->directory = NULL;
+  opts->format = FORMAT_CSV;
+  opts->incremental = 0;
+  opts->compress_level = 0;
+  opts->rotation_period = ROTATE_NONE;
+  opts->rotation_size = 0;
+  opts->jobs = 1;
   opts->dbname = NULL;
   opts->hostname = NULL;
   opts->port = NULL;
@@ -122,173 +351,2041 @@ get_opts(int argc, char **argv)
     }
   }
 
-  /* get opts */
-  while ((c = getopt(argc, argv, "h:p:U:d:D:q")) != -1)
+  /* get opts */
+  while ((c = getopt(argc, argv, "h:p:U:ad:D:F:i:j:qQr:R:Z:")) != -1)
+  {
+    switch (c)
+    {
+        /* dump all databases */
+      case 'a':
+        opts->alldb = true;
+        break;
+
+        /* specify the database */
+      case 'd':
+        opts->dbname = mystrdup(optarg);
+        break;
+
+        /* specify the directory */
+      case 'D':
+        opts->directory = mystrdup(optarg);
+        break;
+
+        /* specify the output format */
+      case 'F':
+        if (!strcmp(optarg, "csv"))
+        {
+          opts->format = FORMAT_CSV;
+        }
+        else if (!strcmp(optarg, "parquet"))
+        {
+          opts->format = FORMAT_PARQUET;
+        }
+        else
+        {
+          pg_log_error("Unknown format \"%s\".\n", optarg);
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* incremental dump, with a full snapshot every K runs */
+      case 'i':
+        opts->incremental = atoi(optarg);
+        if (opts->incremental <= 0)
+        {
+          pg_log_error("Invalid number of runs between full snapshots.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* number of parallel connections */
+      case 'j':
+        opts->jobs = atoi(optarg);
+        if (opts->jobs <= 0)
+        {
+          pg_log_error("Invalid number of parallel connections.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* don't show headers */
+      case 'q':
+        opts->quiet = true;
+        break;
+
+        /* store query texts in a separate dictionary file */
+      case 'Q':
+        opts->dedup_queries = true;
+        break;
+
+        /* time-based rotation */
+      case 'r':
+        if (!strcmp(optarg, "hour"))
+        {
+          opts->rotation_period = ROTATE_HOUR;
+        }
+        else if (!strcmp(optarg, "day"))
+        {
+          opts->rotation_period = ROTATE_DAY;
+        }
+        else
+        {
+          pg_log_error("Unknown rotation period \"%s\".\n", optarg);
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* size-based rotation */
+      case 'R':
+        errno = 0;
+        opts->rotation_size = strtol(optarg, &end, 10);
+        if (end == optarg || *end != '\0' || errno != 0 ||
+            opts->rotation_size <= 0 || opts->rotation_size > PGCSVSTAT_MAX_ROTATION_SIZE)
+        {
+          pg_log_error("Rotation size must be in range 1..%d MB.\n",
+            PGCSVSTAT_MAX_ROTATION_SIZE);
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* compression level */
+      case 'Z':
+        opts->compress_level = atoi(optarg);
+        if (opts->compress_level < 0 || opts->compress_level > 9)
+        {
+          pg_log_error("Compression level must be in range 0..9.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+#ifndef HAVE_LIBZ
+        if (opts->compress_level > 0)
+        {
+          pg_log_error("Compression is not supported by this build.\n");
+          exit(EXIT_FAILURE);
+        }
+#endif
+        break;
+
+        /* host to connect to */
+      case 'h':
+        opts->hostname = mystrdup(optarg);
+        break;
+
+        /* port to connect to on remote host */
+      case 'p':
+        opts->port = mystrdup(optarg);
+        break;
+
+        /* username */
+      case 'U':
+        opts->username = mystrdup(optarg);
+        break;
+
+      default:
+        pg_log_error("Try \"%s --help\" for more information.\n", progname);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  /* only the per-database statistics of all databases are parallelized */
+  if (opts->jobs > 1 && !opts->alldb)
+  {
+    pg_log_error("-j can only be used with -a.\n");
+    pg_log_info("Try \"%s --help\" for more information.\n", progname);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+static void
+help(const char *progname)
+{
+  printf("%s gathers statistics from a PostgreSQL database.\n\n"
+     "Usage:\n"
+     "  %s [OPTIONS]...\n"
+     "\nGeneral options:\n"
+     "  -a           dump the per-database statistics of all databases\n"
+     "  -d DBNAME    database to connect to\n"
+     "  -D DIRECTORY directory for stats files (defaults to current)\n"
+     "  -F FORMAT    output format (csv or parquet, defaults to csv)\n"
+     "  -i K         only dump tables and indexes whose statistics changed,\n"
+     "               with a full snapshot every K runs\n"
+     "  -j NUM       use this many concurrent connections with -a\n"
+     "  -q           quiet\n"
+     "  -Q           store pg_stat_statements query texts only once, in\n"
+     "               pg_stat_statements_queries.csv\n"
+     "  -r PERIOD    rotate files every PERIOD (hour or day)\n"
+     "  -R SIZE      rotate files bigger than SIZE MB\n"
+     "  -Z LEVEL     compress files with gzip at LEVEL (0-9, defaults to 0)\n"
+     "  --help       show this help, then exit\n"
+     "  --version    output version information, then exit\n"
+     "\nConnection options:\n"
+     "  -h HOSTNAME  database server host or socket directory\n"
+     "  -p PORT      database server port number\n"
+     "  -U USER      connect as specified database user\n"
+     "\nIt creates CSV (or Parquet) files for each report.\n\n"
+     "Report bugs to <guillaume@lelarge.info>.\n",
+     progname, progname);
+}
+
+void *
+myalloc(size_t size)
+{
+  void *ptr = malloc(size);
+
+  if (!ptr)
+  {
+    pg_log_error("out of memory (myalloc)");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+char *
+mystrdup(const char *str)
+{
+  char *result = strdup(str);
+
+  if (!result)
+  {
+    pg_log_error("out of memory (mystrdup)");
+    exit(EXIT_FAILURE);
+  }
+  return result;
+}
+
+/*
+ * Build the real name of an output file, given its base name
+ * (i.e. "directory/view.csv"), the rotation period, the format, and the
+ * compression. A plain file is always a CSV file, and is never rotated.
+ * Parquet files compress their pages themselves, so they never get the
+ * ".gz" extension.
+ */
+void
+build_output_filename(char *dest, size_t size, const char *filename, bool plain)
+{
+  char   base[MAXPGPATH];
+  char   tag[32];
+  char   *ext;
+
+  /* get rid of the extension */
+  strlcpy(base, filename, sizeof(base));
+  ext = strrchr(base, '.');
+  if (ext && !strcmp(ext, ".csv"))
+    *ext = '\0';
+
+  /* compute the rotation tag */
+  tag[0] = '\0';
+  if (plain)
+    ;
+  else if (opts->rotation_period == ROTATE_HOUR)
+    strftime(tag, sizeof(tag), ".%Y-%m-%dT%H", localtime(&run_time));
+  else if (opts->rotation_period == ROTATE_DAY)
+    strftime(tag, sizeof(tag), ".%Y-%m-%d", localtime(&run_time));
+
+  if (opts->format == FORMAT_PARQUET && !plain)
+    snprintf(dest, size, "%s%s.parquet", base, tag);
+  else
+    snprintf(dest, size, "%s%s.csv%s",
+      base, tag, opts->compress_level > 0 ? ".gz" : "");
+}
+
+/*
+ * Rename an output file once it goes over the rotation size (or right away,
+ * with force). The old file keeps the timestamp of the rotation in its name,
+ * followed by a sequence number if a file was already rotated at the same
+ * second.
+ */
+void
+rotate_output_file(const char *filename, bool force)
+{
+  struct stat st;
+  char        rotated[MAXPGPATH];
+  char        suffix[16];
+  char        tag[32];
+  size_t      len = strlen(filename);
+  int         seq;
+
+  if (!force)
+  {
+    if (opts->rotation_size == 0)
+      return;
+    if (stat(filename, &st) != 0 || st.st_size < (off_t) opts->rotation_size * 1024 * 1024)
+      return;
+  }
+
+  /* insert the timestamp before the ".csv[.gz]" (or ".parquet") extension */
+  if (opts->format == FORMAT_PARQUET)
+    strlcpy(suffix, ".parquet", sizeof(suffix));
+  else
+    snprintf(suffix, sizeof(suffix), ".csv%s", opts->compress_level > 0 ? ".gz" : "");
+  if (len < strlen(suffix) || strcmp(filename + len - strlen(suffix), suffix) != 0)
+    return;
+  len -= strlen(suffix);
+  strftime(tag, sizeof(tag), "%Y-%m-%dT%H%M%S", localtime(&run_time));
+  snprintf(rotated, sizeof(rotated), "%.*s.%s%s", (int) len, filename, tag, suffix);
+  for (seq = 1; stat(rotated, &st) == 0; seq++)
+    snprintf(rotated, sizeof(rotated), "%.*s.%s.%d%s", (int) len, filename, tag, seq, suffix);
+
+  if (rename(filename, rotated) != 0)
+  {
+    pg_log_error("Cannot rename file %s to %s, errno %d\n", filename, rotated, errno);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Open an output file in append mode, compressed or not.
+ *
+ * A Parquet file is opened to add the row groups of the query result to it.
+ * If it can't be (it has other columns, after an upgrade for example), it is
+ * rotated, and a new file is started.
+ */
+outfile *
+outfile_open(const char *filename, PGresult *res, bool plain)
+{
+  outfile     *f;
+  struct stat st;
+
+  f = (outfile *) myalloc(sizeof(outfile));
+
+  /* get the real filename, and rotate the file if needed */
+  build_output_filename(f->filename, sizeof(f->filename), filename, plain);
+  if (!plain)
+    rotate_output_file(f->filename, false);
+
+  /* a new (or empty) file will need a header */
+  f->empty = stat(f->filename, &st) != 0 || st.st_size == 0;
+
+  f->fd = NULL;
+  f->columns = NULL;
+  f->schema = NULL;
+  f->rowgroups = NULL;
+#ifdef HAVE_LIBZ
+  f->gzfd = NULL;
+#endif
+  if (opts->format == FORMAT_PARQUET && !plain)
+  {
+    f->rowgroups = createPQExpBuffer();
+    f->nrowgroups = 0;
+    f->nrows = 0;
+    f->offset = 0;
+    parquet_schema(f, res);
+
+    f->fd = fopen(f->filename, f->empty ? "w+b" : "r+b");
+    if (f->fd && !f->empty && !parquet_read_footer(f, st.st_size))
+    {
+      pg_log_warning("Cannot add rows to file %s, starting a new one", f->filename);
+      fclose(f->fd);
+      rotate_output_file(f->filename, true);
+      resetPQExpBuffer(f->rowgroups);
+      f->nrowgroups = 0;
+      f->nrows = 0;
+      f->offset = 0;
+      f->empty = true;
+      f->fd = fopen(f->filename, "w+b");
+    }
+  }
+#ifdef HAVE_LIBZ
+  else if (opts->compress_level > 0)
+  {
+    char mode[4];
+
+    /* each run appends a new gzip member to the file */
+    snprintf(mode, sizeof(mode), "ab%d", opts->compress_level);
+    f->gzfd = gzopen(f->filename, mode);
+    if (f->gzfd)
+      gzbuffer(f->gzfd, PGCSVSTAT_GZ_BUFFER_SIZE);
+  }
+#endif
+  else
+    f->fd = fopen(f->filename, "a");
+
+#ifdef HAVE_LIBZ
+  if (!f->fd && !f->gzfd)
+#else
+  if (!f->fd)
+#endif
+  {
+    pg_log_error("Cannot open file %s, errno %d\n", f->filename, errno);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  return f;
+}
+
+/*
+ * Write a string to an output file.
+ */
+void
+outfile_write(outfile *f, const char *str)
+{
+#ifdef HAVE_LIBZ
+  if (f->gzfd)
+  {
+    gzputs(f->gzfd, str);
+    return;
+  }
+#endif
+  fputs(str, f->fd);
+}
+
+/*
+ * Write binary data to an output file.
+ */
+void
+outfile_write_bytes(outfile *f, const char *data, size_t len)
+{
+#ifdef HAVE_LIBZ
+  if (f->gzfd)
+  {
+    gzwrite(f->gzfd, data, len);
+    return;
+  }
+#endif
+  fwrite(data, 1, len, f->fd);
+}
+
+/*
+ * Flush and close an output file, and quit if it couldn't be written.
+ */
+void
+outfile_close(outfile *f)
+{
+  bool failed = false;
+
+#ifdef HAVE_LIBZ
+  if (f->gzfd)
+    failed = gzclose(f->gzfd) != Z_OK;
+#endif
+  if (f->fd)
+  {
+    failed = ferror(f->fd) != 0;
+    if (fclose(f->fd) != 0)
+      failed = true;
+  }
+  if (failed)
+  {
+    pg_log_error("Cannot write file %s, errno %d\n", f->filename, errno);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+  if (f->schema)
+  {
+    destroyPQExpBuffer(f->schema);
+    destroyPQExpBuffer(f->rowgroups);
+    free(f->columns);
+  }
+  free(f);
+}
+
+/*
+ * Write a query result as CSV lines.
+ */
+void
+write_csv(outfile *f, PGresult *res, bool quiet)
+{
+  int nfields;
+  int nrows;
+  int i, j;
+
+  /* get the number of fields */
+  nrows = PQntuples(res);
+  nfields = PQnfields(res);
+
+  /* print a header */
+  if (!quiet && f->empty)
+  {
+    for (j = 0; j < nfields; j++)
+    {
+      outfile_write(f, PQfname(res, j));
+      if (j < nfields - 1)
+        outfile_write(f, ";");
+    }
+    outfile_write(f, "\n");
+  }
+
+  /* for each row, dump the information */
+  for (i = 0; i < nrows; i++)
+  {
+    for (j = 0; j < nfields; j++)
+    {
+      outfile_write(f, PQgetvalue(res, i, j));
+      if (j < nfields - 1)
+        outfile_write(f, ";");
+    }
+    outfile_write(f, "\n");
+  }
+}
+
+/*
+ * Append an unsigned LEB128 varint to a buffer.
+ */
+void
+append_varint(PQExpBuffer buf, uint64 value)
+{
+  char byte;
+
+  do
+  {
+    byte = value & 0x7F;
+    value >>= 7;
+    if (value)
+      byte |= 0x80;
+    appendPQExpBufferChar(buf, byte);
+  } while (value);
+}
+
+/*
+ * Append the nbytes least significant bytes of a value to a buffer,
+ * in little-endian order.
+ */
+void
+append_le(PQExpBuffer buf, uint64 value, int nbytes)
+{
+  int i;
+
+  for (i = 0; i < nbytes; i++)
+    appendPQExpBufferChar(buf, (char) ((value >> (8 * i)) & 0xFF));
+}
+
+/*
+ * Append values of "width" bits to a buffer, least significant bit first,
+ * padding them with zeros up to "padded" values (a multiple of 8, so that
+ * the values end on a byte).
+ */
+void
+append_bitpacked(PQExpBuffer buf, const uint64 *values, int n, int padded, int width)
+{
+  unsigned char byte = 0;
+  int           nbits = 0;
+  int           i;
+
+  for (i = 0; i < padded; i++)
+  {
+    uint64 value = i < n ? values[i] : 0;
+    int    remaining = width;
+
+    while (remaining > 0)
+    {
+      int take = Min(remaining, 8 - nbits);
+
+      byte |= (value & ((1 << take) - 1)) << nbits;
+      value >>= take;
+      remaining -= take;
+      nbits += take;
+      if (nbits == 8)
+      {
+        appendPQExpBufferChar(buf, (char) byte);
+        byte = 0;
+        nbits = 0;
+      }
+    }
+  }
+}
+
+/*
+ * Append values with the RLE/bit-packing hybrid encoding of Parquet, as a
+ * single bit-packed run.
+ */
+void
+append_hybrid(PQExpBuffer buf, const uint64 *values, int n, int width)
+{
+  int ngroups = (n + 7) / 8;
+
+  append_varint(buf, ((uint64) ngroups << 1) | 1);
+  append_bitpacked(buf, values, n, ngroups * 8, width);
+}
+
+/*
+ * Append integers with the DELTA_BINARY_PACKED encoding of Parquet: the
+ * first value, and then blocks of 128 deltas, each one being the minimum
+ * delta of the block followed by 4 miniblocks of 32 deltas minus this
+ * minimum, bit-packed at the width of their biggest value. Deltas wrap
+ * around at the width of the type, as the readers do.
+ */
+void
+append_delta_packed(PQExpBuffer buf, const int64 *values, int n, int bits)
+{
+  int64  deltas[128];
+  uint64 packed[128];
+  int    first, i, k;
+
+  append_varint(buf, 128);
+  append_varint(buf, 4);
+  append_varint(buf, n);
+  append_varint(buf, n > 0 ? ((uint64) values[0] << 1) ^ (uint64) (values[0] >> 63) : 0);
+
+  for (first = 1; first < n; first += 128)
+  {
+    int   count = Min(n - first, 128);
+    int   widths[4];
+    int64 mindelta = 0;
+
+    for (i = 0; i < count; i++)
+    {
+      uint64 delta = (uint64) values[first + i] - (uint64) values[first + i - 1];
+
+      deltas[i] = bits == 32 ? (int64) (int32) (uint32) delta : (int64) delta;
+      if (i == 0 || deltas[i] < mindelta)
+        mindelta = deltas[i];
+    }
+    for (i = 0; i < count; i++)
+      packed[i] = (uint64) deltas[i] - (uint64) mindelta;
+
+    append_varint(buf, ((uint64) mindelta << 1) ^ (uint64) (mindelta >> 63));
+
+    /* widths of the miniblocks, zero for the ones past the last delta */
+    for (k = 0; k < 4; k++)
+    {
+      uint64 max = 0;
+      int    width = 0;
+
+      for (i = 32 * k; i < Min(count, 32 * (k + 1)); i++)
+        max |= packed[i];
+      while (width < 64 && (max >> width) != 0)
+        width++;
+      widths[k] = width;
+      appendPQExpBufferChar(buf, (char) width);
+    }
+
+    /* the miniblocks past the last delta are left out */
+    for (k = 0; k < 4 && 32 * k < count; k++)
+      append_bitpacked(buf, packed + 32 * k, Min(count - 32 * k, 32), 32, widths[k]);
+  }
+}
+
+/*
+ * Add a value to a dictionary if it isn't already there,
+ * and return its index.
+ */
+int
+dictionary_add(dictionary *dict, char *value)
+{
+  uint32 hash = 2166136261u;
+  char   *c;
+  int    slot;
+  int    i;
+
+  /* grow the hash table when it is half full */
+  if (dict->nvalues * 2 >= dict->size)
+  {
+    int newsize = dict->size ? dict->size * 2 : 1024;
+
+    dict->values = (char **) realloc(dict->values, newsize * sizeof(char *));
+    dict->slots = (int *) realloc(dict->slots, newsize * sizeof(int));
+    if (!dict->values || !dict->slots)
+    {
+      pg_log_error("out of memory (dictionary_add)");
+      exit(EXIT_FAILURE);
+    }
+    dict->size = newsize;
+
+    /* rehash the known values */
+    memset(dict->slots, -1, newsize * sizeof(int));
+    for (i = 0; i < dict->nvalues; i++)
+    {
+      uint32 h = 2166136261u;
+
+      for (c = dict->values[i]; *c; c++)
+        h = (h ^ (unsigned char) *c) * 16777619u;
+      for (slot = h & (newsize - 1); dict->slots[slot] >= 0; slot = (slot + 1) & (newsize - 1))
+        ;
+      dict->slots[slot] = i;
+    }
+  }
+
+  /* FNV-1a hash, and linear probing */
+  for (c = value; *c; c++)
+    hash = (hash ^ (unsigned char) *c) * 16777619u;
+  for (slot = hash & (dict->size - 1); dict->slots[slot] >= 0; slot = (slot + 1) & (dict->size - 1))
+  {
+    if (!strcmp(dict->values[dict->slots[slot]], value))
+      return dict->slots[slot];
+  }
+
+  /* new value */
+  dict->values[dict->nvalues] = value;
+  dict->slots[slot] = dict->nvalues;
+  return dict->nvalues++;
+}
+
+/*
+ * Append the header of a field of a Thrift struct, in the compact protocol.
+ * lastid is the identifier of the previous field of the struct.
+ */
+void
+thrift_field(PQExpBuffer buf, int *lastid, int id, int type)
+{
+  if (id > *lastid && id - *lastid <= 15)
+    appendPQExpBufferChar(buf, (char) ((id - *lastid) << 4 | type));
+  else
+  {
+    appendPQExpBufferChar(buf, (char) type);
+    append_varint(buf, ((uint32) id << 1) ^ (uint32) (id >> 31));
+  }
+  *lastid = id;
+}
+
+/*
+ * Append an integer field (i32 or i64) of a Thrift struct.
+ */
+void
+thrift_int(PQExpBuffer buf, int *lastid, int id, int type, int64 value)
+{
+  thrift_field(buf, lastid, id, type);
+  append_varint(buf, ((uint64) value << 1) ^ (uint64) (value >> 63));
+}
+
+/*
+ * Append a string field of a Thrift struct.
+ */
+void
+thrift_string(PQExpBuffer buf, int *lastid, int id, const char *value)
+{
+  thrift_field(buf, lastid, id, THRIFT_BINARY);
+  append_varint(buf, strlen(value));
+  appendPQExpBufferStr(buf, value);
+}
+
+/*
+ * Append the header of a list field of a Thrift struct. The caller then
+ * appends its elements.
+ */
+void
+thrift_list(PQExpBuffer buf, int *lastid, int id, int size, int elemtype)
+{
+  thrift_field(buf, lastid, id, THRIFT_LIST);
+  if (size < 15)
+    appendPQExpBufferChar(buf, (char) (size << 4 | elemtype));
+  else
+  {
+    appendPQExpBufferChar(buf, (char) (0xF0 | elemtype));
+    append_varint(buf, size);
+  }
+}
+
+/*
+ * Read a varint. All the functions reading Thrift return false if the data
+ * is truncated or malformed.
+ */
+bool
+thrift_read_varint(thriftreader *r, uint64 *value)
+{
+  int shift;
+
+  *value = 0;
+  for (shift = 0; r->p < r->end && shift < 64; shift += 7)
+  {
+    *value |= (uint64) (*r->p & 0x7F) << shift;
+    if (!(*r->p++ & 0x80))
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Read the header of a field of a struct, its type being THRIFT_STOP at the
+ * end of the struct.
+ */
+bool
+thrift_read_field(thriftreader *r, int *lastid, int *type)
+{
+  uint64 id;
+  int    delta;
+
+  if (r->p >= r->end)
+    return false;
+  *type = *r->p & 0x0F;
+  delta = *r->p++ >> 4;
+  if (*type == THRIFT_STOP)
+    return true;
+  if (delta)
+    *lastid += delta;
+  else
+  {
+    if (!thrift_read_varint(r, &id))
+      return false;
+    *lastid = (int) (int16) ((id >> 1) ^ -(id & 1));
+  }
+  return true;
+}
+
+/*
+ * Read the header of a list.
+ */
+bool
+thrift_read_list(thriftreader *r, int *size, int *elemtype)
+{
+  uint64 n;
+
+  if (r->p >= r->end)
+    return false;
+  *elemtype = *r->p & 0x0F;
+  n = *r->p++ >> 4;
+  if (n == 15 && !thrift_read_varint(r, &n))
+    return false;
+  if (n > (uint64) (r->end - r->p))
+    return false;
+  *size = (int) n;
+  return true;
+}
+
+/*
+ * Skip a value of the given type.
+ */
+bool
+thrift_skip(thriftreader *r, int type)
+{
+  uint64 value;
+  int    size;
+  int    elemtype;
+  int    lastid = 0;
+  int    i;
+
+  switch (type)
+  {
+    case THRIFT_TRUE:
+    case THRIFT_FALSE:
+      /* the value of a boolean field is its type */
+      return true;
+    case THRIFT_BYTE:
+      if (r->p >= r->end)
+        return false;
+      r->p++;
+      return true;
+    case THRIFT_I16:
+    case THRIFT_I32:
+    case THRIFT_I64:
+      return thrift_read_varint(r, &value);
+    case THRIFT_DOUBLE:
+      if (r->end - r->p < 8)
+        return false;
+      r->p += 8;
+      return true;
+    case THRIFT_BINARY:
+      if (!thrift_read_varint(r, &value) || value > (uint64) (r->end - r->p))
+        return false;
+      r->p += value;
+      return true;
+    case THRIFT_LIST:
+    case THRIFT_SET:
+      if (!thrift_read_list(r, &size, &elemtype))
+        return false;
+      for (i = 0; i < size; i++)
+      {
+        /* booleans take a byte each in a list */
+        if (!thrift_skip(r, elemtype == THRIFT_TRUE || elemtype == THRIFT_FALSE ?
+                            THRIFT_BYTE : elemtype))
+          return false;
+      }
+      return true;
+    case THRIFT_STRUCT:
+      for (;;)
+      {
+        if (!thrift_read_field(r, &lastid, &type))
+          return false;
+        if (type == THRIFT_STOP)
+          return true;
+        if (!thrift_skip(r, type))
+          return false;
+      }
+    default:
+      /* there are no maps in the Parquet metadata */
+      return false;
+  }
+}
+
+/*
+ * Read a list of structs, and append its elements as is to a buffer.
+ */
+bool
+thrift_copy_list(thriftreader *r, PQExpBuffer buf, int *size)
+{
+  const unsigned char *start;
+  int                 elemtype;
+  int                 i;
+
+  if (!thrift_read_list(r, size, &elemtype) || elemtype != THRIFT_STRUCT)
+    return false;
+  start = r->p;
+  for (i = 0; i < *size; i++)
+  {
+    if (!thrift_skip(r, THRIFT_STRUCT))
+      return false;
+  }
+  appendBinaryPQExpBuffer(buf, (const char *) start, r->p - start);
+  return true;
+}
+
+/*
+ * Parse a decimal, as an integer in units of its scale.
+ */
+bool
+parse_decimal(const char *str, int scale, int64 *result)
+{
+  const char *c = str;
+  bool       negative = false;
+  int        digits = 0;
+
+  *result = 0;
+  if (*c == '-' || *c == '+')
+    negative = *c++ == '-';
+  if (!isdigit((unsigned char) *c))
+    return false;
+
+  for (; isdigit((unsigned char) *c); c++)
+    *result = *result * 10 + (*c - '0');
+  if (*c == '.')
+  {
+    for (c++; isdigit((unsigned char) *c) && digits < scale; c++, digits++)
+      *result = *result * 10 + (*c - '0');
+  }
+  for (; digits < scale; digits++)
+    *result *= 10;
+
+  if (negative)
+    *result = -*result;
+  return true;
+}
+
+/*
+ * Parse a timestamp, with or without a time zone, written in the ISO
+ * DateStyle, into microseconds since the Unix epoch (in UTC when the
+ * timestamp has a time zone). Infinite timestamps can't be parsed, and so
+ * become NULLs.
+ */
+bool
+parse_timestamp(const char *str, int64 *result)
+{
+  int        year, month, day, hour, minute, second;
+  int        offset[3] = {0, 0, 0};
+  int        sign = 0;
+  int        usecs = 0;
+  int        digits = 0;
+  int        n = 0;
+  int64      y, era, doe;
+  const char *c;
+
+  if (sscanf(str, "%d-%d-%d %d:%d:%d%n", &year, &month, &day, &hour, &minute, &second, &n) != 6)
+    return false;
+  c = str + n;
+
+  /* fractional seconds */
+  if (*c == '.')
+  {
+    for (c++; isdigit((unsigned char) *c); c++)
+    {
+      if (digits++ < 6)
+        usecs = usecs * 10 + (*c - '0');
+    }
+    for (; digits < 6; digits++)
+      usecs *= 10;
+  }
+
+  /* offset from UTC, in hours, and maybe minutes and seconds */
+  if (*c == '+' || *c == '-')
+  {
+    sign = *c == '+' ? 1 : -1;
+    if (sscanf(c + 1, "%d:%d:%d", &offset[0], &offset[1], &offset[2]) < 1)
+      return false;
+    for (c++; isdigit((unsigned char) *c) || *c == ':'; c++)
+      ;
+  }
+  if (!strcmp(c, " BC"))
+    year = 1 - year;
+  else if (*c)
+    return false;
+
+  /* days since the epoch, in the proleptic Gregorian calendar */
+  y = month <= 2 ? year - 1 : year;
+  era = (y >= 0 ? y : y - 399) / 400;
+  doe = (y - era * 400) * 365 + (y - era * 400) / 4 - (y - era * 400) / 100 +
+        (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+
+  *result = (((era * 146097 + doe - 719468) * 24 + hour) * 60 + minute) * 60 + second;
+  *result -= sign * (offset[0] * 3600 + offset[1] * 60 + offset[2]);
+  *result = *result * 1000000 + usecs;
+  return true;
+}
+
+/*
+ * Choose the Parquet type of a column, given its PostgreSQL type and typmod.
+ * Numerics with a precision of up to 18 digits are decimals stored as 64-bit
+ * integers, other numerics are doubles. Types without a Parquet equivalent
+ * (names, intervals, addresses, LSNs, ...) are strings.
+ */
+void
+parquet_column_type(Oid type, int32 typmod, parquetcolumn *column)
+{
+  column->precision = 0;
+  column->scale = 0;
+
+  switch (type)
+  {
+    case BOOLOID:
+      column->type = COLUMN_BOOLEAN;
+      break;
+    case INT2OID:
+    case INT4OID:
+      column->type = COLUMN_INT32;
+      break;
+    case INT8OID:
+    case OIDOID:
+      column->type = COLUMN_INT64;
+      break;
+    case NUMERICOID:
+      column->type = COLUMN_DOUBLE;
+      if (typmod >= VARHDRSZ)
+      {
+        column->precision = ((typmod - VARHDRSZ) >> 16) & 0xFFFF;
+        /* the scale is an 11-bit signed integer since v15 */
+        column->scale = (((typmod - VARHDRSZ) & 0x7FF) ^ 1024) - 1024;
+        if (column->precision <= 18 && column->scale >= 0 &&
+            column->scale <= column->precision)
+          column->type = COLUMN_DECIMAL;
+      }
+      break;
+    case TIMESTAMPOID:
+      column->type = COLUMN_TIMESTAMP;
+      break;
+    case TIMESTAMPTZOID:
+      column->type = COLUMN_TIMESTAMPTZ;
+      break;
+    case FLOAT4OID:
+      column->type = COLUMN_FLOAT;
+      break;
+    case FLOAT8OID:
+      column->type = COLUMN_DOUBLE;
+      break;
+    default:
+      column->type = COLUMN_STRING;
+      break;
+  }
+}
+
+/*
+ * Build the schema of a Parquet file from a query result: the root, and
+ * then an optional column per field.
+ */
+void
+parquet_schema(outfile *f, PGresult *res)
+{
+  int nfields = PQnfields(res);
+  int lastid = 0;
+  int j;
+
+  f->columns = (parquetcolumn *) myalloc(Max(nfields, 1) * sizeof(parquetcolumn));
+  f->schema = createPQExpBuffer();
+  f->nschema = nfields + 1;
+
+  thrift_string(f->schema, &lastid, 4, "schema");
+  thrift_int(f->schema, &lastid, 5, THRIFT_I32, nfields);
+  appendPQExpBufferChar(f->schema, THRIFT_STOP);
+
+  for (j = 0; j < nfields; j++)
+  {
+    parquetcolumn *column = &f->columns[j];
+    int           logicalid = 0;
+    int           typeid = 0;
+
+    parquet_column_type(PQftype(res, j), PQfmod(res, j), column);
+
+    lastid = 0;
+    switch (column->type)
+    {
+      case COLUMN_BOOLEAN:
+        thrift_int(f->schema, &lastid, 1, THRIFT_I32, PARQUET_BOOLEAN);
+        break;
+      case COLUMN_INT32:
+        thrift_int(f->schema, &lastid, 1, THRIFT_I32, PARQUET_INT32);
+        break;
+      case COLUMN_FLOAT:
+        thrift_int(f->schema, &lastid, 1, THRIFT_I32, PARQUET_FLOAT);
+        break;
+      case COLUMN_DOUBLE:
+        thrift_int(f->schema, &lastid, 1, THRIFT_I32, PARQUET_DOUBLE);
+        break;
+      case COLUMN_STRING:
+        thrift_int(f->schema, &lastid, 1, THRIFT_I32, PARQUET_BYTE_ARRAY);
+        break;
+      default:
+        thrift_int(f->schema, &lastid, 1, THRIFT_I32, PARQUET_INT64);
+        break;
+    }
+    thrift_int(f->schema, &lastid, 3, THRIFT_I32, PARQUET_OPTIONAL);
+    thrift_string(f->schema, &lastid, 4, PQfname(res, j));
+
+    /* converted type, and logical type */
+    switch (column->type)
+    {
+      case COLUMN_DECIMAL:
+        thrift_int(f->schema, &lastid, 6, THRIFT_I32, PARQUET_DECIMAL);
+        thrift_int(f->schema, &lastid, 7, THRIFT_I32, column->scale);
+        thrift_int(f->schema, &lastid, 8, THRIFT_I32, column->precision);
+        thrift_field(f->schema, &lastid, 10, THRIFT_STRUCT);
+        thrift_field(f->schema, &logicalid, 5, THRIFT_STRUCT);
+        thrift_int(f->schema, &typeid, 1, THRIFT_I32, column->scale);
+        thrift_int(f->schema, &typeid, 2, THRIFT_I32, column->precision);
+        appendPQExpBufferChar(f->schema, THRIFT_STOP);
+        appendPQExpBufferChar(f->schema, THRIFT_STOP);
+        break;
+      case COLUMN_TIMESTAMP:
+      case COLUMN_TIMESTAMPTZ:
+        /* the converted type always means UTC */
+        if (column->type == COLUMN_TIMESTAMPTZ)
+          thrift_int(f->schema, &lastid, 6, THRIFT_I32, PARQUET_TIMESTAMP_MICROS);
+        thrift_field(f->schema, &lastid, 10, THRIFT_STRUCT);
+        thrift_field(f->schema, &logicalid, 8, THRIFT_STRUCT);
+        thrift_field(f->schema, &typeid, 1,
+                     column->type == COLUMN_TIMESTAMPTZ ? THRIFT_TRUE : THRIFT_FALSE);
+        thrift_field(f->schema, &typeid, 2, THRIFT_STRUCT);
+        /* MICROS, an empty struct in the TimeUnit union */
+        appendPQExpBufferChar(f->schema, 2 << 4 | THRIFT_STRUCT);
+        appendPQExpBufferChar(f->schema, THRIFT_STOP);
+        appendPQExpBufferChar(f->schema, THRIFT_STOP);
+        appendPQExpBufferChar(f->schema, THRIFT_STOP);
+        appendPQExpBufferChar(f->schema, THRIFT_STOP);
+        break;
+      case COLUMN_STRING:
+        thrift_int(f->schema, &lastid, 6, THRIFT_I32, PARQUET_UTF8);
+        thrift_field(f->schema, &lastid, 10, THRIFT_STRUCT);
+        thrift_field(f->schema, &logicalid, 1, THRIFT_STRUCT);
+        appendPQExpBufferChar(f->schema, THRIFT_STOP);
+        appendPQExpBufferChar(f->schema, THRIFT_STOP);
+        break;
+      default:
+        break;
+    }
+    appendPQExpBufferChar(f->schema, THRIFT_STOP);
+  }
+}
+
+/*
+ * Read the footer of a Parquet file written by a previous run, so that this
+ * run adds its row groups to the ones already there. Returns false if the
+ * file isn't a Parquet file, or if its schema isn't the one of this run.
+ */
+bool
+parquet_read_footer(outfile *f, off_t size)
+{
+  unsigned char trailer[8];
+  unsigned char *footer;
+  PQExpBuffer   schema;
+  thriftreader  r;
+  uint32        len;
+  uint64        value;
+  int           nschema = 0;
+  int           lastid = 0;
+  int           type = THRIFT_STOP;
+  bool          ok;
+
+  if (size < 12 || fseeko(f->fd, size - 8, SEEK_SET) != 0 ||
+      fread(trailer, 1, 8, f->fd) != 8 ||
+      memcmp(trailer + 4, PGCSVSTAT_PARQUET_MAGIC, 4) != 0)
+    return false;
+  len = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (uint32) trailer[3] << 24;
+  if (len > size - 12)
+    return false;
+
+  footer = (unsigned char *) myalloc(len);
+  if (fseeko(f->fd, size - 8 - len, SEEK_SET) != 0 || fread(footer, 1, len, f->fd) != len)
+  {
+    free(footer);
+    return false;
+  }
+
+  /* keep the schema to compare it, and the row groups as is */
+  schema = createPQExpBuffer();
+  r.p = footer;
+  r.end = footer + len;
+  for (ok = true; ok; )
+  {
+    ok = thrift_read_field(&r, &lastid, &type);
+    if (!ok || type == THRIFT_STOP)
+      break;
+    if (lastid == 2 && type == THRIFT_LIST)
+      ok = thrift_copy_list(&r, schema, &nschema);
+    else if (lastid == 3 && type == THRIFT_I64)
+    {
+      ok = thrift_read_varint(&r, &value);
+      f->nrows = (int64) ((value >> 1) ^ -(value & 1));
+    }
+    else if (lastid == 4 && type == THRIFT_LIST)
+      ok = thrift_copy_list(&r, f->rowgroups, &f->nrowgroups);
+    else
+      ok = thrift_skip(&r, type);
+  }
+
+  ok = ok && nschema == f->nschema && schema->len == f->schema->len &&
+       memcmp(schema->data, f->schema->data, schema->len) == 0;
+  f->offset = size - 8 - len;
+
+  destroyPQExpBuffer(schema);
+  free(footer);
+  return ok;
+}
+
+#ifdef HAVE_LIBZ
+/*
+ * Compress the body of a page with gzip, for the GZIP codec.
+ */
+void
+parquet_compress(PQExpBuffer dest, const char *data, size_t len)
+{
+  z_stream zs;
+  uLong    bound;
+
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, opts->compress_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    pg_log_error("out of memory (parquet_compress)");
+    exit(EXIT_FAILURE);
+  }
+
+  bound = deflateBound(&zs, len);
+  if (!enlargePQExpBuffer(dest, bound))
+  {
+    pg_log_error("out of memory (parquet_compress)");
+    exit(EXIT_FAILURE);
+  }
+  zs.next_in = (Bytef *) data;
+  zs.avail_in = len;
+  zs.next_out = (Bytef *) dest->data + dest->len;
+  zs.avail_out = bound;
+  if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+  {
+    pg_log_error("could not compress data: %s", zs.msg ? zs.msg : "unknown error");
+    exit(EXIT_FAILURE);
+  }
+  dest->len += zs.total_out;
+  dest->data[dest->len] = '\0';
+  deflateEnd(&zs);
+}
+#endif
+
+/*
+ * Append a page (its header, then its body, compressed with -Z) to a column
+ * chunk, and add its sizes to the ones of the chunk.
+ */
+void
+parquet_write_page(PQExpBuffer chunk, int pagetype, int encoding, int nvalues,
+                   PQExpBuffer body, int64 *uncompressed, int64 *compressed)
+{
+  PQExpBuffer header = createPQExpBuffer();
+  PQExpBuffer data = body;
+  int         lastid = 0;
+  int         pagelastid = 0;
+
+#ifdef HAVE_LIBZ
+  if (opts->compress_level > 0)
+  {
+    data = createPQExpBuffer();
+    parquet_compress(data, body->data, body->len);
+  }
+#endif
+
+  thrift_int(header, &lastid, 1, THRIFT_I32, pagetype);
+  thrift_int(header, &lastid, 2, THRIFT_I32, body->len);
+  thrift_int(header, &lastid, 3, THRIFT_I32, data->len);
+  if (pagetype == PARQUET_DATA_PAGE)
+  {
+    thrift_field(header, &lastid, 5, THRIFT_STRUCT);
+    thrift_int(header, &pagelastid, 1, THRIFT_I32, nvalues);
+    thrift_int(header, &pagelastid, 2, THRIFT_I32, encoding);
+    thrift_int(header, &pagelastid, 3, THRIFT_I32, PARQUET_RLE);
+    thrift_int(header, &pagelastid, 4, THRIFT_I32, PARQUET_RLE);
+  }
+  else
+  {
+    thrift_field(header, &lastid, 7, THRIFT_STRUCT);
+    thrift_int(header, &pagelastid, 1, THRIFT_I32, nvalues);
+    thrift_int(header, &pagelastid, 2, THRIFT_I32, encoding);
+  }
+  appendPQExpBufferChar(header, THRIFT_STOP);
+  appendPQExpBufferChar(header, THRIFT_STOP);
+
+  appendBinaryPQExpBuffer(chunk, header->data, header->len);
+  appendBinaryPQExpBuffer(chunk, data->data, data->len);
+  *uncompressed += header->len + body->len;
+  *compressed += header->len + data->len;
+
+  if (data != body)
+    destroyPQExpBuffer(data);
+  destroyPQExpBuffer(header);
+}
+
+/*
+ * Write a row group of a Parquet file, and add its metadata to the footer.
+ *
+ * Each column chunk is a single data page (after a dictionary page for the
+ * strings), starting with the definition levels (1 for a value, 0 for a
+ * NULL) as a bit-packed run. Integers, decimals, and timestamps are
+ * delta-encoded, or stored as is when it is smaller (the rows are different
+ * relations, so the deltas only pay on ordered columns, like OIDs and
+ * timestamps). Strings go through a dictionary, the page only having their
+ * indexes in the dictionary.
+ */
+void
+write_parquet_rowgroup(outfile *f, PGresult *res, int first, int nrows)
+{
+  PQExpBuffer rowgroup = createPQExpBuffer();
+  PQExpBuffer metadata = createPQExpBuffer();
+  PQExpBuffer page = createPQExpBuffer();
+  PQExpBuffer definitions = createPQExpBuffer();
+  PQExpBuffer values = createPQExpBuffer();
+  PQExpBuffer deltas = createPQExpBuffer();
+  uint64      *levels = (uint64 *) myalloc(nrows * sizeof(uint64));
+  uint64      *indexes = (uint64 *) myalloc(nrows * sizeof(uint64));
+  int64       *ints = (int64 *) myalloc(nrows * sizeof(int64));
+  int64       uncompressed = 0;
+  int64       compressed = 0;
+  int         nfields = PQnfields(res);
+  int         lastid = 0;
+  int         i, j;
+
+  thrift_list(metadata, &lastid, 1, nfields, THRIFT_STRUCT);
+
+  for (j = 0; j < nfields; j++)
+  {
+    parquetcolumn *column = &f->columns[j];
+    dictionary    dict = {0, 0, NULL, NULL};
+    off_t         chunkoffset = f->offset + rowgroup->len;
+    off_t         dataoffset = chunkoffset;
+    int64         chunkuncompressed = 0;
+    int64         chunkcompressed = 0;
+    int           encoding = PARQUET_PLAIN;
+    int           physical;
+    int           nvalues = 0;
+    int           chunkid = 0;
+    int           metaid = 0;
+
+    /* parse the values, the ones that can't be parsed becoming NULLs */
+    resetPQExpBuffer(values);
+    for (i = 0; i < nrows; i++)
+    {
+      char  *value = PQgetvalue(res, first + i, j);
+      bool  valid = !PQgetisnull(res, first + i, j);
+      char  *end;
+
+      if (valid)
+      {
+        switch (column->type)
+        {
+          case COLUMN_BOOLEAN:
+            indexes[nvalues] = value[0] == 't';
+            break;
+          case COLUMN_INT32:
+          case COLUMN_INT64:
+            ints[nvalues] = strtoll(value, &end, 10);
+            valid = end != value && *end == '\0';
+            break;
+          case COLUMN_DECIMAL:
+            valid = parse_decimal(value, column->scale, &ints[nvalues]);
+            break;
+          case COLUMN_TIMESTAMP:
+          case COLUMN_TIMESTAMPTZ:
+            valid = parse_timestamp(value, &ints[nvalues]);
+            break;
+          case COLUMN_FLOAT:
+            {
+              float  fvalue = strtof(value, &end);
+              uint32 bits;
+
+              memcpy(&bits, &fvalue, sizeof(bits));
+              append_le(values, bits, 4);
+              valid = end != value;
+            }
+            break;
+          case COLUMN_DOUBLE:
+            {
+              double dvalue = strtod(value, &end);
+              uint64 bits;
+
+              memcpy(&bits, &dvalue, sizeof(bits));
+              append_le(values, bits, 8);
+              valid = end != value;
+            }
+            break;
+          case COLUMN_STRING:
+            indexes[nvalues] = dictionary_add(&dict, value);
+            break;
+        }
+
+        /* forget a float value that couldn't be parsed */
+        if (!valid && (column->type == COLUMN_FLOAT || column->type == COLUMN_DOUBLE))
+          values->len -= column->type == COLUMN_FLOAT ? 4 : 8;
+      }
+
+      levels[i] = valid ? 1 : 0;
+      if (valid)
+        nvalues++;
+    }
+
+    /* encode the values */
+    switch (column->type)
+    {
+      case COLUMN_BOOLEAN:
+        physical = PARQUET_BOOLEAN;
+        append_bitpacked(values, indexes, nvalues, (nvalues + 7) / 8 * 8, 1);
+        break;
+      case COLUMN_FLOAT:
+        physical = PARQUET_FLOAT;
+        break;
+      case COLUMN_DOUBLE:
+        physical = PARQUET_DOUBLE;
+        break;
+      case COLUMN_STRING:
+        physical = PARQUET_BYTE_ARRAY;
+        if (dict.nvalues > 0)
+        {
+          int width = 1;
+
+          /* the dictionary page */
+          for (i = 0; i < dict.nvalues; i++)
+          {
+            append_le(values, strlen(dict.values[i]), 4);
+            appendPQExpBufferStr(values, dict.values[i]);
+          }
+          parquet_write_page(rowgroup, PARQUET_DICTIONARY_PAGE, PARQUET_PLAIN,
+                             dict.nvalues, values,
+                             &chunkuncompressed, &chunkcompressed);
+          dataoffset = f->offset + rowgroup->len;
+
+          /* the indexes, preceded by their width */
+          while ((dict.nvalues - 1) >> width)
+            width++;
+          resetPQExpBuffer(values);
+          appendPQExpBufferChar(values, (char) width);
+          append_hybrid(values, indexes, nvalues, width);
+          encoding = PARQUET_RLE_DICTIONARY;
+        }
+        break;
+      default:
+        {
+          int bits = column->type == COLUMN_INT32 ? 32 : 64;
+
+          physical = bits == 32 ? PARQUET_INT32 : PARQUET_INT64;
+          for (i = 0; i < nvalues; i++)
+            append_le(values, (uint64) ints[i], bits / 8);
+
+          resetPQExpBuffer(deltas);
+          append_delta_packed(deltas, ints, nvalues, bits);
+          if (deltas->len < values->len)
+          {
+            encoding = PARQUET_DELTA_BINARY_PACKED;
+            resetPQExpBuffer(values);
+            appendBinaryPQExpBuffer(values, deltas->data, deltas->len);
+          }
+        }
+        break;
+    }
+
+    /* the data page: the definition levels with their length, the values */
+    resetPQExpBuffer(definitions);
+    append_hybrid(definitions, levels, nrows, 1);
+    resetPQExpBuffer(page);
+    append_le(page, definitions->len, 4);
+    appendBinaryPQExpBuffer(page, definitions->data, definitions->len);
+    appendBinaryPQExpBuffer(page, values->data, values->len);
+    parquet_write_page(rowgroup, PARQUET_DATA_PAGE, encoding, nrows, page,
+                       &chunkuncompressed, &chunkcompressed);
+
+    /* metadata of the column chunk */
+    thrift_int(metadata, &chunkid, 2, THRIFT_I64, chunkoffset);
+    thrift_field(metadata, &chunkid, 3, THRIFT_STRUCT);
+    thrift_int(metadata, &metaid, 1, THRIFT_I32, physical);
+    thrift_list(metadata, &metaid, 2, encoding == PARQUET_RLE_DICTIONARY ? 3 : 2, THRIFT_I32);
+    append_varint(metadata, PARQUET_RLE << 1);
+    if (encoding != PARQUET_DELTA_BINARY_PACKED)
+      append_varint(metadata, PARQUET_PLAIN << 1);
+    if (encoding != PARQUET_PLAIN)
+      append_varint(metadata, encoding << 1);
+    thrift_list(metadata, &metaid, 3, 1, THRIFT_BINARY);
+    append_varint(metadata, strlen(PQfname(res, j)));
+    appendPQExpBufferStr(metadata, PQfname(res, j));
+    thrift_int(metadata, &metaid, 4, THRIFT_I32,
+               opts->compress_level > 0 ? PARQUET_GZIP : PARQUET_UNCOMPRESSED);
+    thrift_int(metadata, &metaid, 5, THRIFT_I64, nrows);
+    thrift_int(metadata, &metaid, 6, THRIFT_I64, chunkuncompressed);
+    thrift_int(metadata, &metaid, 7, THRIFT_I64, chunkcompressed);
+    thrift_int(metadata, &metaid, 9, THRIFT_I64, dataoffset);
+    if (dataoffset != chunkoffset)
+      thrift_int(metadata, &metaid, 11, THRIFT_I64, chunkoffset);
+    appendPQExpBufferChar(metadata, THRIFT_STOP);
+    appendPQExpBufferChar(metadata, THRIFT_STOP);
+
+    uncompressed += chunkuncompressed;
+    compressed += chunkcompressed;
+    free(dict.values);
+    free(dict.slots);
+  }
+
+  /* metadata of the row group */
+  thrift_int(metadata, &lastid, 2, THRIFT_I64, uncompressed);
+  thrift_int(metadata, &lastid, 3, THRIFT_I64, nrows);
+  thrift_int(metadata, &lastid, 5, THRIFT_I64, f->offset);
+  thrift_int(metadata, &lastid, 6, THRIFT_I64, compressed);
+  appendPQExpBufferChar(metadata, THRIFT_STOP);
+
+  if (PQExpBufferBroken(rowgroup) || PQExpBufferBroken(metadata) ||
+      PQExpBufferBroken(page) || PQExpBufferBroken(definitions) ||
+      PQExpBufferBroken(values) || PQExpBufferBroken(deltas))
+  {
+    pg_log_error("out of memory (write_parquet_rowgroup)");
+    exit(EXIT_FAILURE);
+  }
+
+  outfile_write_bytes(f, rowgroup->data, rowgroup->len);
+  f->offset += rowgroup->len;
+  appendBinaryPQExpBuffer(f->rowgroups, metadata->data, metadata->len);
+  f->nrowgroups++;
+  f->nrows += nrows;
+
+  free(ints);
+  free(indexes);
+  free(levels);
+  destroyPQExpBuffer(deltas);
+  destroyPQExpBuffer(values);
+  destroyPQExpBuffer(definitions);
+  destroyPQExpBuffer(page);
+  destroyPQExpBuffer(metadata);
+  destroyPQExpBuffer(rowgroup);
+}
+
+/*
+ * Write a query result to a Parquet file.
+ *
+ * Each run adds its row groups after the ones of the previous runs, over the
+ * old footer, and then writes the new footer, with the metadata of all the
+ * row groups. As the new footer has everything the old one had, it always
+ * covers it entirely.
+ */
+void
+write_parquet(outfile *f, PGresult *res)
+{
+  PQExpBuffer footer = createPQExpBuffer();
+  int         nrows = PQntuples(res);
+  int         lastid = 0;
+  int         first;
+
+  if (fseeko(f->fd, f->offset, SEEK_SET) != 0)
+  {
+    pg_log_error("Cannot write file %s, errno %d\n", f->filename, errno);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  if (f->offset == 0)
+  {
+    outfile_write_bytes(f, PGCSVSTAT_PARQUET_MAGIC, 4);
+    f->offset = 4;
+  }
+
+  for (first = 0; first < nrows; first += PGCSVSTAT_PARQUET_ROWGROUP_SIZE)
+  {
+    write_parquet_rowgroup(f, res, first,
+      Min(nrows - first, PGCSVSTAT_PARQUET_ROWGROUP_SIZE));
+  }
+
+  thrift_int(footer, &lastid, 1, THRIFT_I32, 1);
+  thrift_list(footer, &lastid, 2, f->nschema, THRIFT_STRUCT);
+  appendBinaryPQExpBuffer(footer, f->schema->data, f->schema->len);
+  thrift_int(footer, &lastid, 3, THRIFT_I64, f->nrows);
+  thrift_list(footer, &lastid, 4, f->nrowgroups, THRIFT_STRUCT);
+  appendBinaryPQExpBuffer(footer, f->rowgroups->data, f->rowgroups->len);
+  thrift_string(footer, &lastid, 6, "pgcsvstat version " PGCSVSTAT_VERSION);
+  appendPQExpBufferChar(footer, THRIFT_STOP);
+  append_le(footer, footer->len, 4);
+  appendPQExpBufferStr(footer, PGCSVSTAT_PARQUET_MAGIC);
+
+  if (PQExpBufferBroken(footer))
+  {
+    pg_log_error("out of memory (write_parquet)");
+    exit(EXIT_FAILURE);
+  }
+
+  outfile_write_bytes(f, footer->data, footer->len);
+  destroyPQExpBuffer(footer);
+}
+
+/*
+ * Look for a key in a hash table.
+ */
+bool
+hashtable_lookup(hashtable *h, uint64 key, uint64 *value)
+{
+  int slot;
+
+  if (h->size == 0)
+    return false;
+
+  for (slot = (key * UINT64CONST(0x9E3779B97F4A7C15)) >> 32 & (h->size - 1);
+       h->used[slot];
+       slot = (slot + 1) & (h->size - 1))
+  {
+    if (h->keys[slot] == key)
+    {
+      if (value)
+        *value = h->values[slot];
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Insert a key in a hash table, or update its value.
+ */
+void
+hashtable_insert(hashtable *h, uint64 key, uint64 value)
+{
+  int slot;
+
+  /* grow the hash table when it is half full */
+  if (h->nentries * 2 >= h->size)
+  {
+    hashtable old = *h;
+    int       i;
+
+    h->size = old.size ? old.size * 2 : 1024;
+    h->nentries = 0;
+    h->keys = (uint64 *) myalloc(h->size * sizeof(uint64));
+    h->values = (uint64 *) myalloc(h->size * sizeof(uint64));
+    h->used = (bool *) myalloc(h->size * sizeof(bool));
+    memset(h->used, 0, h->size * sizeof(bool));
+
+    for (i = 0; i < old.size; i++)
+    {
+      if (old.used[i])
+        hashtable_insert(h, old.keys[i], old.values[i]);
+    }
+
+    free(old.keys);
+    free(old.values);
+    free(old.used);
+  }
+
+  for (slot = (key * UINT64CONST(0x9E3779B97F4A7C15)) >> 32 & (h->size - 1);
+       h->used[slot] && h->keys[slot] != key;
+       slot = (slot + 1) & (h->size - 1))
+    ;
+
+  if (!h->used[slot])
+  {
+    h->used[slot] = true;
+    h->keys[slot] = key;
+    h->nentries++;
+  }
+  h->values[slot] = value;
+}
+
+/*
+ * Execute a query, and quit on errors.
+ */
+PGresult *
+sql_exec_query(const char *query)
+{
+  PGresult *res;
+
+  /* make the call */
+  res = PQexec(conn, query);
+
+  /* check and deal with errors */
+  if (!res || PQresultStatus(res) > 2)
+  {
+    pg_log_error("query failed: %s\n", PQerrorMessage(conn));
+    pg_log_info("query was: %s\n", query);
+
+    PQclear(res);
+    PQfinish(conn);
+    exit(-1);
+  }
+
+  return res;
+}
+
+/*
+ * Write a query result in the output format.
+ */
+void
+write_result(outfile *f, PGresult *res, bool quiet)
+{
+  if (opts->format == FORMAT_PARQUET)
+    write_parquet(f, res);
+  else
+    write_csv(f, res, quiet);
+}
+
+/*
+ * Store a query result in an output file.
+ */
+void
+sql_write_result(const char *filename, PGresult *res, bool quiet)
+{
+  outfile *fdcsv;
+
+  /* open the csv file */
+  fdcsv = outfile_open(filename, res, false);
+
+  /* dump the information */
+  write_result(fdcsv, res, quiet);
+
+  /* close the csv file */
+  outfile_close(fdcsv);
+}
+
+/*
+ * Actual code to extrac statistics from the database
+ * and to store the output data in CSV files.
+ */
+int
+sql_exec(const char *query, const char* filename, bool quiet)
+{
+  PGresult *res;
+
+  /* per-database statistics of all databases go through the parallel slots */
+  if (current_dbname)
+  {
+    sql_exec_parallel(query, filename, NULL);
+    return 0;
+  }
+
+  res = sql_exec_query(query);
+  sql_write_result(filename, res, quiet);
+
+  /* cleanup */
+  PQclear(res);
+
+  return 0;
+}
+
+/*
+ * Compute a 64-bit FNV-1a hash of all the columns of a row, except
+ * the first one (the timestamp of the run).
+ */
+uint64
+row_fingerprint(PGresult *res, int row)
+{
+  uint64 hash = UINT64CONST(14695981039346656037);
+  int    j;
+  char   *c;
+
+  for (j = 1; j < PQnfields(res); j++)
+  {
+    for (c = PQgetvalue(res, row, j); *c; c++)
+      hash = (hash ^ (unsigned char) *c) * UINT64CONST(1099511628211);
+
+    /* separate columns, and NULL from empty values */
+    hash = (hash ^ (PQgetisnull(res, row, j) ? 1 : 0xff)) * UINT64CONST(1099511628211);
+  }
+
+  return hash;
+}
+
+/*
+ * Load the fingerprints of the previous run, and return the number of runs
+ * already done (zero if there is no state file yet).
+ *
+ * The state file has the number of runs and the identifier of the output
+ * file written by the previous run on its first line, and then one
+ * "key fingerprint" line per object.
+ */
+int
+load_incremental_state(const char *filename, hashtable *state, uint64 *outfileid)
+{
+  FILE   *fd;
+  char   line[64];
+  int    runs = 0;
+  uint64 key;
+  uint64 fingerprint;
+
+  *outfileid = 0;
+  fd = fopen(filename, "r");
+  if (!fd)
+    return 0;
+
+  if (!fgets(line, sizeof(line), fd) ||
+      sscanf(line, "%d " UINT64_FORMAT, &runs, outfileid) < 1)
+    runs = 0;
+
+  while (fscanf(fd, UINT64_FORMAT " " UINT64_FORMAT, &key, &fingerprint) == 2)
+    hashtable_insert(state, key, fingerprint);
+
+  fclose(fd);
+
+  return runs;
+}
+
+/*
+ * Save the fingerprints of this run. The file is written under a temporary
+ * name, and then renamed, so that a crash never leaves a partial state.
+ */
+void
+save_incremental_state(const char *filename, int runs, uint64 outfileid,
+                       PGresult *res, int keycolumn)
+{
+  char tmpfilename[MAXPGPATH];
+  FILE *fd;
+  int  i;
+
+  snprintf(tmpfilename, sizeof(tmpfilename), "%s.tmp", filename);
+  fd = fopen(tmpfilename, "w");
+  if (!fd)
+  {
+    pg_log_error("Cannot open file %s, errno %d\n", tmpfilename, errno);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(fd, "%d " UINT64_FORMAT "\n", runs, outfileid);
+  for (i = 0; i < PQntuples(res); i++)
+  {
+    fprintf(fd, "%s " UINT64_FORMAT "\n",
+      PQgetvalue(res, i, keycolumn), row_fingerprint(res, i));
+  }
+
+  if (fclose(fd) != 0 || rename(tmpfilename, filename) != 0)
+  {
+    pg_log_error("Cannot write file %s, errno %d\n", filename, errno);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Keep only the rows whose fingerprint changed since the previous run.
+ * Returns a new result that the caller must clear too.
+ */
+PGresult *
+filter_changed_rows(hashtable *state, PGresult *res, int keycolumn)
+{
+  PGresult  *changed;
+  int       nchanged = 0;
+  int       i, j;
+
+  /* copy the rows that changed */
+  changed = PQcopyResult(res, PG_COPYRES_ATTRS);
+  if (!changed)
   {
-    switch (c)
+    pg_log_error("out of memory (filter_changed_rows)");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < PQntuples(res); i++)
+  {
+    uint64 fingerprint;
+
+    if (hashtable_lookup(state, (uint64) strtoll(PQgetvalue(res, i, keycolumn), NULL, 10), &fingerprint)
+        && fingerprint == row_fingerprint(res, i))
+      continue;
+
+    for (j = 0; j < PQnfields(res); j++)
     {
-        /* specify the database */
-      case 'd':
-        opts->dbname = mystrdup(optarg);
-        break;
+      if (PQgetisnull(res, i, j))
+        PQsetvalue(changed, nchanged, j, NULL, -1);
+      else
+        PQsetvalue(changed, nchanged, j, PQgetvalue(res, i, j), PQgetlength(res, i, j));
+    }
+    nchanged++;
+  }
 
-        /* specify the directory */
-      case 'D':
-        opts->directory = mystrdup(optarg);
-        break;
+  return changed;
+}
 
-        /* don't show headers */
-      case 'q':
-        opts->quiet = true;
-        break;
+/*
+ * Store the rows of a query result that changed since the previous run,
+ * and then save the state of this run.
+ *
+ * A full snapshot is written on the first run, every K runs, and on the
+ * first write to a new output file (after a rotation, the state of the
+ * previous run being about another file), so that each file can be read on
+ * its own. The state is only saved once the rows are written, so that a run
+ * failing in between doesn't lose changes.
+ */
+void
+sql_write_incremental_result(const char *filename, const char *statefilename,
+                             PGresult *res, const char *keyname)
+{
+  hashtable   state = {0, 0, NULL, NULL, NULL};
+  outfile     *fdcsv;
+  PGresult    *filtered = res;
+  struct stat st;
+  uint64      outfileid;
+  uint64      previousid;
+  int         keycolumn = PQfnumber(res, keyname);
+  int         runs;
 
-        /* host to connect to */
-      case 'h':
-        opts->hostname = mystrdup(optarg);
-        break;
+  /* open the csv file, the file being identified by its inode */
+  fdcsv = outfile_open(filename, res, false);
+  outfileid = stat(fdcsv->filename, &st) == 0 ? (uint64) st.st_ino : 0;
 
-        /* port to connect to on remote host */
-      case 'p':
-        opts->port = mystrdup(optarg);
-        break;
+  runs = load_incremental_state(statefilename, &state, &previousid);
+  if (runs % opts->incremental != 0 && outfileid == previousid)
+    filtered = filter_changed_rows(&state, res, keycolumn);
 
-        /* username */
-      case 'U':
-        opts->username = mystrdup(optarg);
-        break;
+  /* dump the information, and only then remember it */
+  write_result(fdcsv, filtered, opts->quiet);
+  outfile_close(fdcsv);
+  save_incremental_state(statefilename, runs + 1, outfileid, res, keycolumn);
 
-      default:
-        pg_log_error("Try \"%s --help\" for more information.\n", progname);
-        exit(EXIT_FAILURE);
-    }
-  }
+  /* cleanup */
+  if (filtered != res)
+    PQclear(filtered);
+  free(state.keys);
+  free(state.values);
+  free(state.used);
 }
 
-
-static void
-help(const char *progname)
+/*
+ * Free a batch of queries, and its result contexts.
+ */
+void
+free_batch(querybatch *b)
 {
-  printf("%s gathers statistics from a PostgreSQL database.\n\n"
-     "Usage:\n"
-     "  %s [OPTIONS]...\n"
-     "\nGeneral options:\n"
-     "  -d DBNAME    database to connect to\n"
-     "  -D DIRECTORY directory for stats files (defaults to current)\n"
-     "  -q           quiet\n"
-     "  --help       show this help, then exit\n"
-     "  --version    output version information, then exit\n"
-     "\nConnection options:\n"
-     "  -h HOSTNAME  database server host or socket directory\n"
-     "  -p PORT      database server port number\n"
-     "  -U USER      connect as specified database user\n"
-     "\nIt creates CSV files for each report.\n\n"
-     "Report bugs to <guillaume@lelarge.info>.\n",
-     progname, progname);
+  destroyPQExpBuffer(b->query);
+  free(b->contexts);
+  free(b);
 }
 
-void *
-myalloc(size_t size)
+/*
+ * Result handler of the parallel slots: store the result of a per-database
+ * query, filtering it first in incremental mode. The results of a batch come
+ * in the order of its queries. The state of the incremental mode is kept per
+ * database, as relids are only unique inside a database.
+ */
+bool
+dump_result_handler(PGresult *res, PGconn *conn, void *context)
 {
-  void *ptr = malloc(size);
+  querybatch    *b = (querybatch *) context;
+  resultcontext *rc = &b->contexts[b->next++];
 
-  if (!ptr)
+  /* the queries after a failed one aren't executed */
+  if (PQresultStatus(res) != PGRES_TUPLES_OK)
   {
-    pg_log_error("out of memory (myalloc)");
-    exit(EXIT_FAILURE);
+    pg_log_error("query failed on database \"%s\": %s\n",
+      PQdb(conn), PQerrorMessage(conn));
+    PQclear(res);
+    free_batch(b);
+    return false;
   }
-  return ptr;
+
+  if (rc->keyname && opts->incremental > 0)
+    sql_write_incremental_result(rc->filename, rc->statefilename, res, rc->keyname);
+  else
+    sql_write_result(rc->filename, res, opts->quiet);
+
+  /* cleanup, the slot clears the result itself */
+  if (b->next == b->ncontexts)
+    free_batch(b);
+
+  return true;
 }
 
-char *
-mystrdup(const char *str)
+/*
+ * Add a query on the current database to its batch. Its result is stored
+ * by dump_result_handler() once the batch is sent, and the result is
+ * available.
+ */
+void
+sql_exec_parallel(const char *query, const char *filename, const char *keyname)
 {
-  char *result = strdup(str);
+  resultcontext *rc;
 
-  if (!result)
+  if (!batch)
   {
-    pg_log_error("out of memory (mystrdup)");
-    exit(EXIT_FAILURE);
+    batch = (querybatch *) myalloc(sizeof(querybatch));
+    memset(batch, 0, sizeof(querybatch));
+    batch->query = createPQExpBuffer();
   }
-  return result;
+  if (batch->ncontexts == batch->size)
+  {
+    batch->size = batch->size ? batch->size * 2 : 8;
+    batch->contexts = (resultcontext *) realloc(batch->contexts,
+      batch->size * sizeof(resultcontext));
+    if (!batch->contexts)
+    {
+      pg_log_error("out of memory (sql_exec_parallel)");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  rc = &batch->contexts[batch->ncontexts++];
+  strlcpy(rc->filename, filename, sizeof(rc->filename));
+  snprintf(rc->statefilename, sizeof(rc->statefilename),
+    "%s.%u.state", filename, current_dboid);
+  rc->keyname = keyname;
+  appendPQExpBuffer(batch->query, "%s;\n", query);
 }
 
 /*
- * Actual code to extrac statistics from the database
- * and to store the output data in CSV files.
+ * Send the queries of the current database at once, on an idle parallel
+ * slot, so that a single connection does all the work of a database, and
+ * the connections only go from one database to the other between two
+ * batches.
  */
-int
-sql_exec(const char *query, const char* filename, bool quiet)
+void
+send_batch()
 {
-  PGresult    *res;
-  FILE        *fdcsv;
-  struct stat st;
-  int         nfields;
-  int         nrows;
-  int         i, j;
-  int         size;
+  ParallelSlot *slot;
 
-  /* open the csv file */
-  fdcsv = fopen(filename, "a");
-  if (!fdcsv)
+  if (!batch)
+    return;
+
+  slot = ParallelSlotsGetIdle(slots, current_dbname);
+  if (!slot)
   {
-    pg_log_error("Cannot open file %s, errno %d\n", filename, errno);
-    PQfinish(conn);
+    ParallelSlotsTerminate(slots);
     exit(EXIT_FAILURE);
   }
 
-  /* get size of file */
-  stat(filename, &st);
-  size = st.st_size;
-
-  /* make the call */
-  res = PQexec(conn, query);
-
-  /* check and deal with errors */
-  if (!res || PQresultStatus(res) > 2)
+  ParallelSlotSetHandler(slot, dump_result_handler, batch);
+  if (!PQsendQuery(slot->connection, batch->query->data))
   {
-    pg_log_error("query failed: %s\n", PQerrorMessage(conn));
-    pg_log_info("query was: %s\n", query);
-
-    PQclear(res);
-    PQfinish(conn);
-    exit(-1);
+    pg_log_error("query failed on database \"%s\": %s\n",
+      current_dbname, PQerrorMessage(slot->connection));
+    pg_log_info("query was: %s\n", batch->query->data);
+    ParallelSlotsTerminate(slots);
+    exit(EXIT_FAILURE);
   }
+  batch = NULL;
+}
 
-  /* get the number of fields */
-  nrows = PQntuples(res);
-  nfields = PQnfields(res);
+/*
+ * Same as sql_exec(), but only for the objects whose statistics changed
+ * since the previous run (objects are identified by the keyname column).
+ */
+void
+sql_exec_incremental(const char *query, const char *filename, const char *keyname)
+{
+  PGresult *res;
+  char     statefilename[MAXPGPATH];
 
-  /* print a header */
-  if (!quiet && size == 0)
+  /* per-database statistics of all databases go through the parallel slots */
+  if (current_dbname)
   {
-    for (j = 0; j < nfields; j++)
-    {
-      fprintf(fdcsv, "%s", PQfname(res, j));
-    if (j < nfields - 1)
-      fprintf(fdcsv, ";");
-    }
-    fprintf(fdcsv, "\n");
+    sql_exec_parallel(query, filename, keyname);
+    return;
   }
 
-  /* for each row, dump the information */
-  for (i = 0; i < nrows; i++)
+  res = sql_exec_query(query);
+  if (opts->incremental > 0)
   {
-    for (j = 0; j < nfields; j++)
-    {
-      fprintf(fdcsv, "%s", PQgetvalue(res, i, j));
-      if (j < nfields - 1)
-        fprintf(fdcsv, ";");
-    }
-    fprintf(fdcsv, "\n");
+    snprintf(statefilename, sizeof(statefilename), "%s.state", filename);
+    sql_write_incremental_result(filename, statefilename, res, keyname);
   }
+  else
+    sql_write_result(filename, res, opts->quiet);
 
   /* cleanup */
   PQclear(res);
-
-  /* close the csv file */
-  fclose(fdcsv);
-
-  return 0;
 }
 
 /*
@@ -617,17 +2714,18 @@ sql_exec_dump_pgstatwalreceiver()
 void
 sql_exec_dump_pgstatalltables()
 {
-  char query[1024];
+  char query[2048];
   char filename[1024];
 
   snprintf(query, sizeof(query),
-    "SELECT date_trunc('seconds', now()), relid, schemaname, relname, "
+    "SELECT date_trunc('seconds', now()), %srelid, schemaname, relname, "
     "seq_scan%s, seq_tup_read, idx_scan%s, idx_tup_fetch, "
     "n_tup_ins, n_tup_upd, n_tup_del"
     "%s%s%s%s%s%s%s "
     "FROM pg_stat_all_tables "
     "WHERE schemaname <> 'information_schema' "
     "ORDER BY schemaname, relname",
+    opts->alldb ? "current_database() AS datname, " : "",
     backend_minimum_version(16, 0) ? ", date_trunc('seconds', last_seq_scan) AS last_seq_scan" : "",
     backend_minimum_version(16, 0) ? ", date_trunc('seconds', last_idx_scan) AS last_idx_scan" : "",
     backend_minimum_version(8, 3) ? ", n_tup_hot_upd" : "",
@@ -641,7 +2739,7 @@ sql_exec_dump_pgstatalltables()
   snprintf(filename, sizeof(filename),
     "%s/pg_stat_all_tables.csv", opts->directory);
 
-  sql_exec(query, filename, opts->quiet);
+  sql_exec_incremental(query, filename, "relid");
 }
 
 /*
@@ -654,19 +2752,20 @@ sql_exec_dump_pgstatallindexes()
   char filename[1024];
 
   snprintf(query, sizeof(query),
-    "SELECT date_trunc('seconds', now()), "
+    "SELECT date_trunc('seconds', now()), %s"
     "relid, indexrelid, schemaname, relname, indexrelname, "
     "idx_scan%s, idx_tup_read, idx_tup_fetch "
     "FROM pg_stat_all_indexes "
     "WHERE schemaname <> 'information_schema' "
     "ORDER BY schemaname, relname",
+    opts->alldb ? "current_database() AS datname, " : "",
     backend_minimum_version(16, 0) ? ", date_trunc('seconds', last_idx_scan) AS last_idx_scan" : ""
   );
 
   snprintf(filename, sizeof(filename),
     "%s/pg_stat_all_indexes.csv", opts->directory);
 
-  sql_exec(query, filename, opts->quiet);
+  sql_exec_incremental(query, filename, "indexrelid");
 }
 
 /*
@@ -679,15 +2778,16 @@ sql_exec_dump_pgstatioalltables()
   char filename[1024];
 
   snprintf(query, sizeof(query),
-    "SELECT date_trunc('seconds', now()), * "
+    "SELECT date_trunc('seconds', now()), %s* "
     "FROM pg_statio_all_tables "
     "WHERE schemaname <> 'information_schema' "
-    "ORDER BY schemaname, relname");
+    "ORDER BY schemaname, relname",
+    opts->alldb ? "current_database() AS datname, " : "");
 
   snprintf(filename, sizeof(filename),
     "%s/pg_statio_all_tables.csv", opts->directory);
 
-  sql_exec(query, filename, opts->quiet);
+  sql_exec_incremental(query, filename, "relid");
 }
 
 /*
@@ -700,15 +2800,16 @@ sql_exec_dump_pgstatioallindexes()
   char filename[1024];
 
   snprintf(query, sizeof(query),
-    "SELECT date_trunc('seconds', now()), * "
+    "SELECT date_trunc('seconds', now()), %s* "
     "FROM pg_statio_all_indexes "
     "WHERE schemaname <> 'information_schema' "
-    "ORDER BY schemaname, relname");
+    "ORDER BY schemaname, relname",
+    opts->alldb ? "current_database() AS datname, " : "");
 
   snprintf(filename, sizeof(filename),
     "%s/pg_statio_all_indexes.csv", opts->directory);
 
-  sql_exec(query, filename, opts->quiet);
+  sql_exec_incremental(query, filename, "indexrelid");
 }
 
 /*
@@ -721,10 +2822,11 @@ sql_exec_dump_pgstatioallsequences()
   char filename[1024];
 
   snprintf(query, sizeof(query),
-    "SELECT date_trunc('seconds', now()), * "
+    "SELECT date_trunc('seconds', now()), %s* "
     "FROM pg_statio_all_sequences "
     "WHERE schemaname <> 'information_schema' "
-    "ORDER BY schemaname, relname");
+    "ORDER BY schemaname, relname",
+    opts->alldb ? "current_database() AS datname, " : "");
 
   snprintf(filename, sizeof(filename),
     "%s/pg_statio_all_sequences.csv", opts->directory);
@@ -742,10 +2844,11 @@ sql_exec_dump_pgstatuserfunctions()
   char filename[1024];
 
   snprintf(query, sizeof(query),
-    "SELECT date_trunc('seconds', now()), * "
+    "SELECT date_trunc('seconds', now()), %s* "
     "FROM pg_stat_user_functions "
     "WHERE schemaname <> 'information_schema' "
-    "ORDER BY schemaname, funcname");
+    "ORDER BY schemaname, funcname",
+    opts->alldb ? "current_database() AS datname, " : "");
 
   snprintf(filename, sizeof(filename),
     "%s/pg_stat_user_functions.csv", opts->directory);
@@ -763,12 +2866,13 @@ sql_exec_dump_pgclass_size()
   char filename[1024];
 
   snprintf(query, sizeof(query),
-    "SELECT date_trunc('seconds', now()), n.nspname, c.relname, c.relkind, "
+    "SELECT date_trunc('seconds', now()), %sn.nspname, c.relname, c.relkind, "
     "c.reltuples, c.relpages%s%s "
     "FROM pg_class c "
     "JOIN pg_namespace n ON n.oid=c.relnamespace "
     "WHERE n.nspname <> 'information_schema' "
     "ORDER BY n.nspname, c.relname",
+    opts->alldb ? "current_database() AS datname, " : "",
     backend_minimum_version(9, 2) ? ", c.relallvisible" : "",
     backend_minimum_version(8, 1) ? ", pg_relation_size(c.oid)" : "");
 
@@ -785,20 +2889,27 @@ sql_exec_dump_pgclass_size()
 void
 sql_exec_dump_pgstatstatements()
 {
-  char query[1024];
-  char filename[1024];
+  char     query[2048];
+  char     filename[1024];
+  PGresult *res;
 
+  /*
+   * With a query dictionary, the query texts are not needed (not even read
+   * by the server), but the queryid is always needed.
+   */
   snprintf(query, sizeof(query),
     "SELECT date_trunc('seconds', now()), r.rolname, d.datname, "
-    "%sregexp_replace(query, E'\n', ' ', 'g') as query, %scalls, %s, rows, "
+    "%s%scalls, %s, rows, "
     "shared_blks_hit, shared_blks_read, shared_blks_dirtied, shared_blks_written, "
     "local_blks_hit, local_blks_read, local_blks_dirtied, local_blks_written, "
     "temp_blks_read, temp_blks_written%s%s%s%s%s%s "
-    "FROM pg_stat_statements q "
+    "FROM %s q "
     "LEFT JOIN pg_database d ON q.dbid=d.oid "
     "LEFT JOIN pg_roles r ON q.userid=r.oid "
     "ORDER BY r.rolname, d.datname",
-    backend_minimum_version(14, 0) ? "toplevel, queryid, " : "",
+    opts->dedup_queries ?
+      (backend_minimum_version(14, 0) ? "toplevel, queryid, " : "queryid, ") :
+      (backend_minimum_version(14, 0) ? "toplevel, queryid, regexp_replace(query, E'[\n\r]', ' ', 'g') as query, " : "regexp_replace(query, E'[\n\r]', ' ', 'g') as query, "),
     backend_minimum_version(13, 0) ? "plans, total_plan_time, min_plan_time, max_plan_time, mean_plan_time, stddev_plan_time, " : "",
     backend_minimum_version(13, 0) ? "total_exec_time, min_exec_time, max_exec_time, mean_exec_time, stddev_exec_time" : "total_time",
     backend_minimum_version(17, 0) ? ", shared_blk_read_time, shared_blk_write_time, local_blk_read_time, local_blk_write_time" : ", blk_read_time, blk_write_time",
@@ -806,12 +2917,165 @@ sql_exec_dump_pgstatstatements()
     backend_minimum_version(13, 0) ? ", wal_records, wal_fpi, wal_bytes" : "",
     backend_minimum_version(15, 0) ? ", jit_functions, jit_generation_time, jit_inlining_count, jit_inlining_time, jit_optimization_count, jit_optimization_time, jit_emission_count, jit_emission_time" : "",
     backend_minimum_version(17, 0) ? ", date_trunc('seconds', stats_since) AS stats_since " : "",
-    backend_minimum_version(17, 0) ? ", date_trunc('seconds', minmax_stats_since) AS minmax_stats_since " : "");
+    backend_minimum_version(17, 0) ? ", date_trunc('seconds', minmax_stats_since) AS minmax_stats_since " : "",
+    opts->dedup_queries ? "pg_stat_statements(false)" : "pg_stat_statements");
 
   snprintf(filename, sizeof(filename),
     "%s/pg_stat_statements.csv", opts->directory);
 
-  sql_exec(query, filename, opts->quiet);
+  res = sql_exec_query(query);
+  sql_write_result(filename, res, opts->quiet);
+
+  /* add the texts of the new queries to the dictionary */
+  if (opts->dedup_queries)
+    sql_exec_dump_pgstatstatements_queries(res);
+
+  PQclear(res);
+}
+
+/*
+ * Load the queryids already stored in the query dictionary.
+ */
+void
+load_query_dictionary(const char *filename, hashtable *known)
+{
+  char line[8192];
+  bool newline = true;
+#ifdef HAVE_LIBZ
+  gzFile fd;
+
+  /* gzip can also read uncompressed files */
+  fd = gzopen(filename, "rb");
+  if (!fd)
+    return;
+
+  while (gzgets(fd, line, sizeof(line)))
+#else
+  FILE *fd;
+
+  fd = fopen(filename, "r");
+  if (!fd)
+    return;
+
+  while (fgets(line, sizeof(line), fd))
+#endif
+  {
+    char  *end;
+    int64 queryid;
+
+    /* the queryid is at the start of a line (this skips the header) */
+    if (newline)
+    {
+      queryid = strtoll(line, &end, 10);
+      if (end != line && *end == ';')
+        hashtable_insert(known, (uint64) queryid, 0);
+    }
+
+    /* long query texts need more than one read */
+    newline = line[strlen(line) - 1] == '\n';
+  }
+
+#ifdef HAVE_LIBZ
+  gzclose(fd);
+#else
+  fclose(fd);
+#endif
+}
+
+/*
+ * Append the texts of the queries never seen before to the query dictionary.
+ */
+void
+sql_exec_dump_pgstatstatements_queries(PGresult *res)
+{
+  char         filename[1024];
+  char         realfilename[MAXPGPATH];
+  hashtable    known = {0, 0, NULL, NULL, NULL};
+  PQExpBuffer  queryids;
+  PGresult     *texts;
+  const char   *params[1];
+  outfile      *fddict;
+  int          queryid_column;
+  int          i;
+  char         *c;
+
+  snprintf(filename, sizeof(filename),
+    "%s/pg_stat_statements_queries.csv", opts->directory);
+  build_output_filename(realfilename, sizeof(realfilename), filename, true);
+  load_query_dictionary(realfilename, &known);
+
+  /* collect the unknown queryids */
+  queryid_column = PQfnumber(res, "queryid");
+  queryids = createPQExpBuffer();
+  appendPQExpBufferChar(queryids, '{');
+  for (i = 0; i < PQntuples(res); i++)
+  {
+    uint64 queryid;
+
+    if (PQgetisnull(res, i, queryid_column))
+      continue;
+    queryid = (uint64) strtoll(PQgetvalue(res, i, queryid_column), NULL, 10);
+    if (hashtable_lookup(&known, queryid, NULL))
+      continue;
+    hashtable_insert(&known, queryid, 0);
+    if (queryids->len > 1)
+      appendPQExpBufferChar(queryids, ',');
+    appendPQExpBufferStr(queryids, PQgetvalue(res, i, queryid_column));
+  }
+  appendPQExpBufferChar(queryids, '}');
+
+  /* nothing new */
+  if (queryids->len == 2)
+  {
+    destroyPQExpBuffer(queryids);
+    free(known.keys);
+    free(known.values);
+    free(known.used);
+    return;
+  }
+
+  /* fetch the texts of the new queries */
+  params[0] = queryids->data;
+  texts = PQexecParams(conn,
+    "SELECT DISTINCT ON (queryid) queryid, query "
+    "FROM pg_stat_statements(true) "
+    "WHERE queryid = ANY($1::bigint[]) "
+    "ORDER BY queryid",
+    1, NULL, params, NULL, NULL, 0);
+
+  /* check and deal with errors */
+  if (!texts || PQresultStatus(texts) != PGRES_TUPLES_OK)
+  {
+    pg_log_error("query failed: %s\n", PQerrorMessage(conn));
+    PQclear(texts);
+    PQfinish(conn);
+    exit(-1);
+  }
+
+  /* append them to the dictionary, on one line each */
+  fddict = outfile_open(filename, NULL, true);
+  if (!opts->quiet && fddict->empty)
+    outfile_write(fddict, "queryid;query\n");
+  for (i = 0; i < PQntuples(texts); i++)
+  {
+    for (c = PQgetvalue(texts, i, 1); *c; c++)
+    {
+      if (*c == '\n' || *c == '\r')
+        *c = ' ';
+    }
+    outfile_write(fddict, PQgetvalue(texts, i, 0));
+    outfile_write(fddict, ";");
+    outfile_write(fddict, PQgetvalue(texts, i, 1));
+    outfile_write(fddict, "\n");
+  }
+  outfile_close(fddict);
+
+  /* cleanup */
+  PQclear(texts);
+  destroyPQExpBuffer(queryids);
+  free(known.keys);
+  free(known.values);
+  free(known.used);
 }
 
 /*
@@ -989,6 +3253,67 @@ sql_exec_dump_pgstatprogressvacuum()
   sql_exec(query, filename, opts->quiet);
 }
 
+/*
+ * Dump the statistics local to the current database.
+ */
+void
+dump_database_stats()
+{
+  sql_exec_dump_pgstatalltables();
+  sql_exec_dump_pgstatallindexes();
+  sql_exec_dump_pgstatioalltables();
+  sql_exec_dump_pgstatioallindexes();
+  sql_exec_dump_pgstatioallsequences();
+  if (backend_minimum_version(8, 4))
+    sql_exec_dump_pgstatuserfunctions();
+  sql_exec_dump_pgclass_size();
+}
+
+/*
+ * Dump the statistics local to each database the user can connect to. The
+ * databases are dumped on opts->jobs parallel connections, the queries of a
+ * database being sent at once, on a single connection.
+ */
+void
+dump_all_databases_stats(ConnParams *cparams, const char *progname)
+{
+  PGresult *res;
+  int      i;
+
+  res = sql_exec_query(
+    "SELECT oid, datname FROM pg_database "
+    "WHERE datallowconn AND has_database_privilege(oid, 'CONNECT') "
+    "ORDER BY datname");
+
+  /* the current connection is reused for its database */
+  slots = ParallelSlotsSetup(opts->jobs, cparams, progname, false,
+    opts->format == FORMAT_PARQUET ? PGCSVSTAT_PARQUET_SETUP : NULL);
+  ParallelSlotsAdoptConn(slots, conn);
+  conn = NULL;
+
+  for (i = 0; i < PQntuples(res); i++)
+  {
+    current_dboid = atooid(PQgetvalue(res, i, 0));
+    current_dbname = PQgetvalue(res, i, 1);
+    if (!opts->quiet)
+      printf("Dumping database \"%s\"\n", current_dbname);
+    dump_database_stats();
+    send_batch();
+  }
+  current_dbname = NULL;
+
+  if (!ParallelSlotsWaitCompletion(slots))
+  {
+    ParallelSlotsTerminate(slots);
+    exit(EXIT_FAILURE);
+  }
+
+  /* cleanup */
+  ParallelSlotsTerminate(slots);
+  PQclear(res);
+}
+
+
 /*
  * Fetch PostgreSQL major and minor numbers
  */
@@ -1190,6 +3515,9 @@ main(int argc, char **argv)
     opts->directory = "./";
   }
 
+  /* every file of this run gets the same rotation timestamp */
+  run_time = time(NULL);
+
   /* Set the connection struct */
   cparams.pghost = opts->hostname;
   cparams.pgport = opts->port;
@@ -1201,9 +3529,20 @@ main(int argc, char **argv)
   /* Connect to the database */
   conn = connectDatabase(&cparams, progname, false, false, false);
 
+  /* timestamps are parsed in the ISO format, strings are written in UTF-8 */
+  if (opts->format == FORMAT_PARQUET)
+    PQclear(sql_exec_query(PGCSVSTAT_PARQUET_SETUP));
+
   /* get version */
   fetch_version();
 
+  /* the query dictionary needs pg_stat_statements(showtext) */
+  if (opts->dedup_queries && !backend_minimum_version(9, 5))
+  {
+    pg_log_warning("You need at least v9.5 to store query texts in a separate file.");
+    opts->dedup_queries = false;
+  }
+
   /* check superuser attribute */
   is_superuser = check_superuser();
 
@@ -1233,14 +3572,9 @@ main(int argc, char **argv)
     sql_exec_dump_pgstatwalreceiver();
   }
 
-  /* grab database stats info */
-  sql_exec_dump_pgstatalltables();
-  sql_exec_dump_pgstatallindexes();
-  sql_exec_dump_pgstatioalltables();
-  sql_exec_dump_pgstatioallindexes();
-  sql_exec_dump_pgstatioallsequences();
-  if (backend_minimum_version(8, 4))
-    sql_exec_dump_pgstatuserfunctions();
+  /* grab database stats info, all databases are done at the end */
+  if (!opts->alldb)
+    dump_database_stats();
 
   /* grab progress stats info */
   if (backend_minimum_version(13, 0))
@@ -1257,12 +3591,15 @@ main(int argc, char **argv)
     sql_exec_dump_pgstatprogressvacuum();
 
   /* grab other informations */
-  sql_exec_dump_pgclass_size();
   if (backend_has_pgstatstatements())
     sql_exec_dump_pgstatstatements();
   if (backend_minimum_version(8, 2) && is_superuser)
     sql_exec_dump_xlog_stat();
 
+  /* grab database stats info of all databases */
+  if (opts->alldb)
+    dump_all_databases_stats(&cparams, progname);
+
   PQfinish(conn);
   return 0;
 }
@@ -10,13 +10,28 @@
  */
 
 
+/*
+ * System headers
+ */
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+
 /*
  * PostgreSQL headers
  */
 #include "postgres_fe.h"
 #include "common/logging.h"
 #include "fe_utils/connect_utils.h"
+#include "fe_utils/parallel_slot.h"
+#include "fe_utils/query_utils.h"
+#include "catalog/pg_tablespace_d.h"
+#include "catalog/pg_type_d.h"
 #include "libpq/pqsignal.h"
+#include "pqexpbuffer.h"
 
 
 /*
@@ -37,6 +52,13 @@
  * Structs
  */
 
+/* output formats of the report */
+typedef enum
+{
+  OUTPUT_TEXT = 0,
+  OUTPUT_JSON
+} output_t;
+
 /* these are the options structure for command line parameters */
 struct options
 {
@@ -44,18 +66,135 @@ struct options
   char *script;
   bool verbose;
 
+  /* execute the report rather than printing a script, and how */
+  bool direct;
+  int  jobs;
+  bool explain;
+  bool alldbs;
+  bool local;
+  output_t output;
+
+  /* capture of this report, and captures to compare */
+  char *capture;
+  char *diff[2];
+  int  ndiffs;
+
+  /* relations whose bloat is estimated, and measured */
+  long bloat_minsize;
+  int  bloat_sample;
+  int  bloat_topk;
+
+  /* time limits of each section, and of the whole report, in seconds */
+  int  timeout;
+  int  budget;
+
+  /* connection parameters */
+  char *dbname;
+  char *hostname;
+  char *port;
+  char *username;
+
   /* version number */
   int  major;
   int  minor;
 };
 
+/* a section of the report, executed in direct mode */
+typedef struct
+{
+  const char *heading;   /* part of the report starting with this section */
+  const char *label;
+  const char *query;
+  bool       expensive;  /* scans big catalogs, or the whole cluster */
+  bool       perdb;      /* executed in every database with -a */
+  int        pending;    /* queries not finished yet, one per database */
+  bool       done;
+  PGresult   *result;    /* kept till the previous sections are printed */
+  char       *error;
+  PQExpBuffer plan;      /* EXPLAIN (ANALYZE, BUFFERS) of the query */
+  PQExpBuffer rows;      /* JSON rows received before it can be printed */
+  bool       opened;     /* its JSON rows are being printed */
+  const char *skipped;   /* why it wasn't executed till its end */
+  int        ndatabases; /* setup step: databases where it was executed */
+  int        nskipped;   /* setup step: databases where it was skipped */
+  double     duration;   /* of its queries, in seconds */
+  int        ntuples;
+  long       bytes;      /* size of the values received */
+} section;
+
+/* a query of a section, in one database */
+typedef struct
+{
+  section    *section;
+  const char *dbname;    /* NULL if the section isn't executed per database */
+  double     start;      /* when the query was sent */
+  bool       received;   /* its result, the plan may follow */
+  bool       explained;  /* its plan is being received */
+  bool       failed;
+} task;
+
+/* a capture file, read one line at a time */
+typedef struct
+{
+  const char *filename;
+  FILE       *fd;
+  char       *line;
+  size_t     size;
+  char       *fields[4]; /* category, key, value, detail */
+  bool       eof;
+} capture;
+
+/* the relfilenode of a relation, in its tablespace */
+typedef struct
+{
+  Oid        tablespace;
+  Oid        filenode;
+} relfile;
+
+/* a file of the data directory without a relation */
+typedef struct
+{
+  char       *path;
+  long long  size;
+  time_t     mtime;
+  const char *dbname;
+} orphan;
+
+/* a relation with more bloat in the second capture */
+typedef struct
+{
+  char      *name;
+  char      *kind;
+  long long before;
+  long long after;
+} bloat_growth;
+
 
 /*
  * Global variables
  */
-struct options *opts;
-extern char    *optarg;
-const char *progname;
+struct options    *opts;
+extern char       *optarg;
+const char        *progname;
+PGconn            *conn = NULL;
+ParallelSlotArray *slots;
+orphan            *orphans = NULL;
+int               norphans = 0;
+int               maxorphans = 0;
+double            orphans_duration = 0;
+section           *sections = NULL;
+int               nsections = 0;
+int               maxsections = 0;
+section           setups[2];         /* the tables read by several sections */
+int               nsetups = 0;
+int               nprinted = 0;
+const char        *next_heading = NULL;
+const char        *current_part = NULL;
+bool              local_part = false;
+char              **databases = NULL;
+int               ndatabases = 0;
+PQExpBuffer       initcmd;
+double            report_start;
 
 
 /*
@@ -69,11 +208,56 @@ char        *pg_strdup(const char *in);
 #endif
 bool        backend_minimum_version(int major, int minor);
 void        execute(char *query);
+void        execute_per_session(char *query);
 void        install_extension(char *extension);
+void        append_bloat_filters(char *sql, size_t size, const char *relation,
+                                 const char *tableoid);
 void        fetch_version(void);
 void        fetch_postmaster_reloadconftime(void);
 void        fetch_postmaster_starttime(void);
+void        add_heading(const char *heading);
 void        fetch_table(char *label, char *query);
+void        fetch_expensive_table(char *label, char *query);
+void        fetch_cluster_table(char *label, char *query);
+void        queue_section(char *label, char *query, bool expensive, bool cluster);
+void        queue_local_section(char *label, PGresult *res, double duration);
+static int  compare_relfiles(const void *a, const void *b);
+static int  compare_orphans(const void *a, const void *b);
+void        find_orphaned_files(PGconn *dbconn);
+void        scan_directory(const char *path, Oid tablespace, relfile *relfiles,
+                           int nrelfiles, time_t fetched, const char *dbname);
+void        queue_orphaned_files(void);
+void        fetch_databases(void);
+bool        execute_or_warn(char *query);
+long        section_timeout(void);
+bool        execute_setup(const char *label, char *query);
+bool        prepare_database(void);
+void        prepare_databases(ConnParams *cparams);
+void        cleanup_databases(ConnParams *cparams);
+double      clock_now(void);
+static bool section_result_handler(PGresult *res, PGconn *conn, void *context);
+void        merge_result(section *s, PGresult *res);
+task        *schedule_tasks(int *ntasks);
+void        run_sections(ConnParams *cparams);
+void        print_ready_sections(void);
+void        json_string(PQExpBuffer buf, const char *str);
+const char  *json_type(Oid type);
+void        json_rows(section *s, PGresult *res);
+void        json_open_section(section *s);
+void        json_close_section(section *s);
+static int  compare_sections(const void *a, const void *b);
+void        print_summary(void);
+int         display_width(const char *str);
+void        print_cell(const char *str, int width, bool right, bool last);
+void        print_result(PGresult *res);
+static int  compare_capture_keys(const void *a, const void *b);
+char        *capture_escape(const char *str);
+void        write_capture(const char *filename);
+void        capture_open(capture *c, const char *filename);
+void        capture_next(capture *c);
+void        format_size(char *buf, size_t size, long long bytes);
+static int  compare_bloat_growths(const void *a, const void *b);
+void        print_diff(void);
 void        fetch_file(char *filename);
 void        fetch_kernelconfig(char *cfg);
 void        exec_command(char *cmd);
@@ -90,10 +274,31 @@ help()
        "Usage:\n"
        "  %s [OPTIONS]\n"
        "\nGeneral options:\n"
+       "  -a            report on all databases with -e\n"
+       "  -e            execute the report rather than generating a SQL script\n"
+       "  -E            also get the plan of each query with -e (executes it twice)\n"
+       "  -B SECONDS    stop executing sections after SECONDS with -e\n"
+       "  -c FILE       save a capture of the report in FILE with -e\n"
+       "  -D FILE       compare two captures (use it twice, first the older)\n"
+       "  -j NUM        execute the sections on NUM connections with -e\n"
+       "                (default is 1)\n"
+       "  -K NUM        measure the bloat of the NUM most bloated tables with\n"
+       "                pgstattuple_approx\n"
+       "  -L            look for orphaned files in the data directory, with -e\n"
+       "                on the server host\n"
+       "  -M SIZE       only estimate the bloat of relations over SIZE MB\n"
+       "  -o FORMAT     output format with -e (text or json)\n"
        "  -s VERSION    generate SQL script for $VERSION release\n"
+       "  -S PERCENT    only estimate the bloat of a sample of the tables\n"
+       "  -t SECONDS    cancel the sections running longer than SECONDS with -e\n"
        "  -v            verbose\n"
        "  -?|--help     show this help, then exit\n"
        "  -V|--version  output version information, then exit\n"
+       "\nConnection options (with -e):\n"
+       "  -h HOSTNAME   database server host or socket directory\n"
+       "  -p PORT       database server port number\n"
+       "  -U USER       connect as specified database user\n"
+       "  -d DBNAME     database to connect to\n\n"
        "Report bugs to <guillaume@lelarge.info>.\n",
        progname, progname);
 }
@@ -110,6 +315,23 @@ get_opts(int argc, char **argv)
   /* set the defaults */
   opts->script = NULL;
   opts->verbose = false;
+  opts->direct = false;
+  opts->jobs = 1;
+  opts->explain = false;
+  opts->alldbs = false;
+  opts->local = false;
+  opts->output = OUTPUT_TEXT;
+  opts->capture = NULL;
+  opts->ndiffs = 0;
+  opts->bloat_minsize = 0;
+  opts->bloat_sample = 0;
+  opts->bloat_topk = 0;
+  opts->timeout = 0;
+  opts->budget = 0;
+  opts->dbname = NULL;
+  opts->hostname = NULL;
+  opts->port = NULL;
+  opts->username = NULL;
 
   /* we should deal quickly with help and version */
   if (argc > 1)
@@ -127,16 +349,156 @@ get_opts(int argc, char **argv)
   }
 
   /* get options */
-  while ((c = getopt(argc, argv, "vs:")) != -1)
+  while ((c = getopt(argc, argv, "h:p:U:d:j:t:B:c:D:K:M:S:aeELo:s:v")) != -1)
   {
     switch (c)
     {
+        /* all databases */
+      case 'a':
+        opts->alldbs = true;
+        break;
+
+        /* time budget of the report */
+      case 'B':
+        opts->budget = atoi(optarg);
+        if (opts->budget <= 0)
+        {
+          pg_log_error("Invalid time budget.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* capture of the report */
+      case 'c':
+        opts->capture = pg_strdup(optarg);
+        break;
+
+        /* captures to compare */
+      case 'D':
+        if (opts->ndiffs == lengthof(opts->diff))
+        {
+          pg_log_error("-D can only be used twice.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        opts->diff[opts->ndiffs++] = pg_strdup(optarg);
+        break;
+
+        /* specify the database */
+      case 'd':
+        opts->dbname = pg_strdup(optarg);
+        break;
+
+        /* execute the report */
+      case 'e':
+        opts->direct = true;
+        break;
+
+        /* get the plans */
+      case 'E':
+        opts->explain = true;
+        break;
+
+        /* host to connect to */
+      case 'h':
+        opts->hostname = pg_strdup(optarg);
+        break;
+
+        /* number of connections */
+      case 'j':
+        opts->jobs = atoi(optarg);
+        if (opts->jobs <= 0)
+        {
+          pg_log_error("Invalid number of jobs.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* output format */
+      case 'o':
+        if (!strcmp(optarg, "text"))
+        {
+          opts->output = OUTPUT_TEXT;
+        }
+        else if (!strcmp(optarg, "json"))
+        {
+          opts->output = OUTPUT_JSON;
+        }
+        else
+        {
+          pg_log_error("Unknown output format \"%s\".\n", optarg);
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* bloat measured on the most bloated tables */
+      case 'K':
+        opts->bloat_topk = atoi(optarg);
+        if (opts->bloat_topk <= 0)
+        {
+          pg_log_error("Invalid number of tables.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* orphaned files in the local data directory */
+      case 'L':
+        opts->local = true;
+        break;
+
+        /* bloat estimated on the big relations */
+      case 'M':
+        opts->bloat_minsize = atol(optarg);
+        if (opts->bloat_minsize <= 0)
+        {
+          pg_log_error("Invalid minimum size.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* port to connect to on remote host */
+      case 'p':
+        opts->port = pg_strdup(optarg);
+        break;
+
+        /* timeout of each section */
+      case 't':
+        opts->timeout = atoi(optarg);
+        if (opts->timeout <= 0)
+        {
+          pg_log_error("Invalid timeout.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* username */
+      case 'U':
+        opts->username = pg_strdup(optarg);
+        break;
+
         /* get script */
       case 's':
         opts->script = pg_strdup(optarg);
         sscanf(opts->script, "%d.%d", &(opts->major), &(opts->minor));
         break;
 
+        /* bloat estimated on a sample of the tables */
+      case 'S':
+        opts->bloat_sample = atoi(optarg);
+        if (opts->bloat_sample <= 0 || opts->bloat_sample >= 100)
+        {
+          pg_log_error("Invalid sample percentage.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
         /* get verbose */
       case 'v':
         opts->verbose = true;
@@ -148,9 +510,30 @@ get_opts(int argc, char **argv)
     }
   }
 
+  if (opts->ndiffs == 1 || (opts->ndiffs == 2 && opts->direct))
+  {
+    pg_log_error("-D needs two captures, and cannot be used with -e.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if ((opts->alldbs || opts->explain || opts->local || opts->output != OUTPUT_TEXT ||
+       opts->capture || opts->timeout > 0 || opts->budget > 0 || opts->jobs > 1 ||
+       opts->dbname || opts->hostname || opts->port || opts->username) && !opts->direct)
+  {
+    pg_log_error("-a, -c, -E, -L, -o, -t, -B, -j, -d, -h, -p and -U can only be used with -e.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (opts->direct && opts->script != NULL)
+  {
+    pg_log_error("-s cannot be used with -e, the version is the server's.\n");
+    exit(EXIT_FAILURE);
+  }
+
   if (opts->script == NULL)
   {
     opts->script = "17";
+    sscanf(opts->script, "%d.%d", &(opts->major), &(opts->minor));
   }
 }
 
@@ -216,16 +599,56 @@ backend_minimum_version(int major, int minor)
 void
 execute(char *query)
 {
+  if (opts->direct)
+    executeCommand(conn, query, opts->verbose);
+  else
     printf("%s;\n", query);
 }
 
+
+/*
+ * Execute query on every session, for session-level settings and temporary
+ * objects
+ */
+void
+execute_per_session(char *query)
+{
+  execute(query);
+  if (opts->direct)
+    appendPQExpBuffer(initcmd, "%s;\n", query);
+}
+
 /*
  * Install extension
  */
 void
 install_extension(char *extension)
 {
-  printf("CREATE EXTENSION IF NOT EXISTS %s;\n", extension);
+  char sql[PGREPORT_DEFAULT_STRING_SIZE];
+
+  snprintf(sql, sizeof(sql), CREATE_EXTENSION_SQL, extension);
+  execute(sql);
+}
+
+
+/*
+ * Append the conditions on the relations whose bloat is estimated
+ *
+ * The size comes from relpages, so it costs nothing. The sample depends on
+ * the hash of the OID of the table, so that it is the same from one report to
+ * the other, and so that the indexes of a table are in the sample of the
+ * table.
+ */
+void
+append_bloat_filters(char *sql, size_t size, const char *relation,
+                     const char *tableoid)
+{
+  if (opts->bloat_minsize > 0)
+    snprintf(sql + strlen(sql), size - strlen(sql), BLOAT_SIZE_FILTER,
+      relation, opts->bloat_minsize * 1024 * 1024);
+  if (opts->bloat_sample > 0)
+    snprintf(sql + strlen(sql), size - strlen(sql), BLOAT_SAMPLE_FILTER,
+      tableoid, opts->bloat_sample);
 }
 
 
@@ -235,8 +658,7 @@ install_extension(char *extension)
 void
 fetch_version()
 {
-  printf("\\echo PostgreSQL version\n");
-  printf("SELECT version();\n");
+  fetch_table("PostgreSQL version", "SELECT version()");
 }
 
 
@@ -246,8 +668,7 @@ fetch_version()
 void
 fetch_postmaster_reloadconftime()
 {
-  printf("\\echo PostgreSQL reload conf time\n");
-  printf("SELECT pg_conf_load_time();\n");
+  fetch_table("PostgreSQL reload conf time", "SELECT pg_conf_load_time()");
 }
 
 
@@ -257,146 +678,1948 @@ fetch_postmaster_reloadconftime()
 void
 fetch_postmaster_starttime()
 {
-  printf("\\echo PostgreSQL start time\n");
-  printf("SELECT pg_postmaster_start_time();\n");
+  fetch_table("PostgreSQL start time", "SELECT pg_postmaster_start_time()");
+}
+
+
+/*
+ * Start a new part of the report
+ */
+void
+add_heading(const char *heading)
+{
+  if (opts->direct)
+    next_heading = heading;
+  else
+    printf("\\echo # %s\n\n", heading);
 }
 
 
 /*
  * Handle query
+ *
+ * In direct mode, the query is only queued, run_sections() executes it.
  */
 void
 fetch_table(char *label, char *query)
 {
-  printf("\\echo %s\n",label);
-  printf("%s;\n",query);
+  queue_section(label, query, false, false);
 }
 
 
 /*
- * Close the PostgreSQL connection, and quit
+ * Handle a query that may take long on big clusters
  */
-static void
-quit_properly(SIGNAL_ARGS)
+void
+fetch_expensive_table(char *label, char *query)
 {
-  exit(EXIT_FAILURE);
+  queue_section(label, query, true, false);
 }
 
 
 /*
- * Main function
+ * Handle a query about the whole cluster, executed only in the current
+ * database, even with -a
  */
-int
-main(int argc, char **argv)
+void
+fetch_cluster_table(char *label, char *query)
 {
-  char       sql[10240];
+  queue_section(label, query, false, true);
+}
 
-  /*
-   * If the user stops the program,
-   * quit nicely.
-   */
-  pqsignal(SIGINT, quit_properly);
 
-  /* Initialize the logging interface */
-  pg_logging_init(argv[0]);
+/*
+ * Print the query in script mode, or queue it in direct mode
+ */
+void
+queue_section(char *label, char *query, bool expensive, bool cluster)
+{
+  if (!opts->direct)
+  {
+    printf("\\echo %s\n",label);
+    printf("%s;\n",query);
+    return;
+  }
 
-  /* Get the program name */
-  progname = get_progname(argv[0]);
+  if (nsections == maxsections)
+  {
+    maxsections = maxsections > 0 ? maxsections * 2 : 64;
+    sections = (section *) pg_realloc(sections, maxsections * sizeof(section));
+  }
+  memset(&sections[nsections], 0, sizeof(section));
+  sections[nsections].heading = next_heading;
+  sections[nsections].label = label;
+  sections[nsections].query = query;
+  sections[nsections].expensive = expensive;
+  sections[nsections].perdb = opts->alldbs && local_part && !cluster;
+  nsections++;
+  next_heading = NULL;
+}
 
-  /* Allocate the options struct */
-  opts = (struct options *) pg_malloc(sizeof(struct options));
 
-  /* Parse the options */
-  get_opts(argc, argv);
+/*
+ * Queue a section computed by pgreport itself, rather than by a query
+ */
+void
+queue_local_section(char *label, PGresult *res, double duration)
+{
+  section *s;
 
-  printf("\\echo =================================================================================\n");
-  printf("\\echo == pgreport SQL script for a %s release =========================================\n", opts->script);
-  printf("\\echo =================================================================================\n");
-  printf("SET application_name to 'pgreport';\n");
+  queue_section(label, NULL, false, true);
+  s = &sections[nsections - 1];
+  merge_result(s, res);
+  s->duration = duration;
+  s->done = true;
+}
 
-  /* Fetch version */
-  printf("\\echo # PostgreSQL Version\n\n");
-  fetch_version();
-  printf("\n");
 
-  /* Create schema, and set if as our search_path */
-  execute(CREATE_SCHEMA);
-  execute(SET_SEARCHPATH);
-  /* Install some extensions if they are not already there */
-  install_extension("pg_buffercache");
-  install_extension("pg_visibility");
-  /* Install some functions/views */
-  execute(CREATE_GETVALUE_FUNCTION_SQL);
-  execute(CREATE_BLOATTABLE_VIEW_SQL);
-  strcat(sql, CREATE_BLOATINDEX_VIEW_SQL_1);
-  strcat(sql, CREATE_BLOATINDEX_VIEW_SQL_2);
-  execute(sql);
-  if (backend_minimum_version(10,0))
+/*
+ * Order relfilenodes, on their tablespace then their filenode
+ */
+static int
+compare_relfiles(const void *a, const void *b)
+{
+  const relfile *ra = (const relfile *) a;
+  const relfile *rb = (const relfile *) b;
+
+  if (ra->tablespace != rb->tablespace)
+    return ra->tablespace < rb->tablespace ? -1 : 1;
+  return ra->filenode < rb->filenode ? -1 : ra->filenode > rb->filenode ? 1 : 0;
+}
+
+
+/*
+ * Order orphaned files, the biggest first
+ */
+static int
+compare_orphans(const void *a, const void *b)
+{
+  const orphan *oa = (const orphan *) a;
+  const orphan *ob = (const orphan *) b;
+
+  return oa->size > ob->size ? -1 : oa->size < ob->size ? 1 : 0;
+}
+
+
+/*
+ * Look for the orphaned files of a database, in the local data directory
+ *
+ * The relfilenodes of the database are fetched once, with their tablespace,
+ * sorted, and each file of its directories is matched against them with a
+ * binary search on the tablespace of the directory and the name of the file,
+ * as a relfilenode is only unique in a tablespace. Only the files without a
+ * relation are stat'ed. A file changed since the relfilenodes were fetched
+ * belongs to a relation created meanwhile, so it isn't an orphan.
+ */
+void
+find_orphaned_files(PGconn *dbconn)
+{
+  PGresult   *res;
+  PGresult   *tablespaces;
+  relfile    *relfiles;
+  int        nrelfiles;
+  char       prefix[32];
+  char       path[MAXPGPATH];
+  char       dbpath[MAXPGPATH];
+  const char *datadir;
+  const char *dboid;
+  time_t     fetched = time(NULL);
+  double     start = clock_now();
+  DIR        *dir;
+  struct dirent *de;
+  int        i;
+
+  res = executeQuery(dbconn, LOCAL_FILENODES_SQL, opts->verbose);
+  nrelfiles = PQntuples(res);
+  relfiles = (relfile *) pg_malloc((nrelfiles + 1) * sizeof(relfile));
+  for (i = 0; i < nrelfiles; i++)
   {
-    execute(CREATE_ORPHANEDFILES_VIEW_SQL2);
+    relfiles[i].tablespace = atooid(PQgetvalue(res, i, 0));
+    relfiles[i].filenode = atooid(PQgetvalue(res, i, 1));
   }
+  PQclear(res);
+  qsort(relfiles, nrelfiles, sizeof(relfile), compare_relfiles);
+
+  res = executeQuery(dbconn, LOCAL_DATABASE_SQL, opts->verbose);
+  datadir = PQgetvalue(res, 0, 0);
+  dboid = PQgetvalue(res, 0, 1);
+
+  /* the default tablespace */
+  snprintf(path, sizeof(path), "%s/base/%s", datadir, dboid);
+  scan_directory(path, DEFAULTTABLESPACE_OID, relfiles, nrelfiles, fetched, PQdb(dbconn));
+
+  /* the other ones, in the directory of this release */
+  if (opts->major >= 10)
+    snprintf(prefix, sizeof(prefix), "PG_%d_", opts->major);
   else
+    snprintf(prefix, sizeof(prefix), "PG_%d.%d_", opts->major, opts->minor);
+  tablespaces = executeQuery(dbconn, LOCAL_TABLESPACES_SQL, opts->verbose);
+  for (i = 0; i < PQntuples(tablespaces); i++)
   {
-    execute(CREATE_ORPHANEDFILES_VIEW_SQL1);
+    snprintf(path, sizeof(path), "%s/pg_tblspc/%s", datadir, PQgetvalue(tablespaces, i, 0));
+    dir = opendir(path);
+    if (!dir)
+    {
+      pg_log_warning("could not open directory \"%s\": %m", path);
+      continue;
+    }
+    while (errno = 0, (de = readdir(dir)) != NULL)
+    {
+      if (strncmp(de->d_name, prefix, strlen(prefix)) != 0)
+        continue;
+      snprintf(dbpath, sizeof(dbpath), "%s/%s/%s", path, de->d_name, dboid);
+      scan_directory(dbpath, atooid(PQgetvalue(tablespaces, i, 0)), relfiles,
+                     nrelfiles, fetched, PQdb(dbconn));
+    }
+    if (errno)
+      pg_log_warning("could not read directory \"%s\": %m", path);
+    closedir(dir);
   }
 
-  /* Fetch postmaster start time */
-  printf("\\echo # PostgreSQL Start time\n\n");
-  fetch_postmaster_starttime();
-  printf("\n");
+  orphans_duration += clock_now() - start;
 
-  /* Fetch reload conf time */
-  printf("\\echo # PostgreSQL Reload conf time\n\n");
-  fetch_postmaster_reloadconftime();
-  printf("\n");
+  /* cleanup */
+  PQclear(tablespaces);
+  PQclear(res);
+  pg_free(relfiles);
+}
 
-  /* Fetch settings by various ways */
-  printf("\\echo # PostgreSQL Configuration\n\n");
-  fetch_table(SETTINGS_BY_SOURCEFILE_TITLE, SETTINGS_BY_SOURCEFILE_SQL);
-  fetch_table(SETTINGS_NOTCONFIGFILE_NOTDEFAULTVALUE_TITLE,
-        SETTINGS_NOTCONFIGFILE_NOTDEFAULTVALUE_SQL);
-  if (backend_minimum_version(9,5))
+
+/*
+ * Add the files of a directory without a relation to the orphans
+ *
+ * The names of the files of a relation start with its relfilenode (16384,
+ * 16384.1, 16384_fsm, ...). The other files (PG_VERSION, pg_filenode.map,
+ * the files of temporary relations, ...) are ignored.
+ */
+void
+scan_directory(const char *path, Oid tablespace, relfile *relfiles,
+               int nrelfiles, time_t fetched, const char *dbname)
+{
+  DIR           *dir;
+  struct dirent *de;
+  struct stat   st;
+  char          value[MAXPGPATH];
+  relfile       key;
+
+  /* a database may have no relation in a tablespace */
+  dir = opendir(path);
+  if (!dir)
   {
-    fetch_table(PGFILESETTINGS_TITLE, PGFILESETTINGS_SQL);
+    if (errno != ENOENT)
+      pg_log_warning("could not open directory \"%s\": %m", path);
+    return;
   }
-  if (backend_minimum_version(10,0))
+
+  key.tablespace = tablespace;
+  while (errno = 0, (de = readdir(dir)) != NULL)
   {
-    fetch_table(PGHBAFILERULES_TITLE, PGHBAFILERULES_SQL);
+    if (!isdigit((unsigned char) de->d_name[0]))
+      continue;
+    key.filenode = (Oid) strtoul(de->d_name, NULL, 10);
+    if (bsearch(&key, relfiles, nrelfiles, sizeof(relfile), compare_relfiles))
+      continue;
+    if (fstatat(dirfd(dir), de->d_name, &st, 0) != 0 || st.st_mtime >= fetched)
+      continue;
+
+    if (norphans == maxorphans)
+    {
+      maxorphans = maxorphans > 0 ? maxorphans * 2 : 64;
+      orphans = (orphan *) pg_realloc(orphans, maxorphans * sizeof(orphan));
+    }
+    snprintf(value, sizeof(value), "%s/%s", path, de->d_name);
+    orphans[norphans].path = pg_strdup(value);
+    orphans[norphans].size = (long long) st.st_size;
+    orphans[norphans].mtime = st.st_mtime;
+    orphans[norphans].dbname = dbname;
+    norphans++;
   }
-  if (backend_minimum_version(15,0))
+  if (errno)
+    pg_log_warning("could not read directory \"%s\": %m", path);
+  closedir(dir);
+}
+
+
+/*
+ * Queue the orphaned files found in every database, the biggest first
+ */
+void
+queue_orphaned_files()
+{
+  PGresult     *res;
+  PGresAttDesc attrs[4];
+  char         value[MAXPGPATH];
+  int          i;
+
+  memset(attrs, 0, sizeof(attrs));
+  attrs[0].name = "orphaned_file";
+  attrs[1].name = "file_size";
+  attrs[2].name = "modification_date";
+  attrs[3].name = "current_database";
+  attrs[0].typid = attrs[1].typid = attrs[2].typid = attrs[3].typid = TEXTOID;
+  res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+  PQsetResultAttrs(res, lengthof(attrs), attrs);
+
+  if (norphans > 0)
+    qsort(orphans, norphans, sizeof(orphan), compare_orphans);
+  for (i = 0; i < norphans; i++)
   {
-    fetch_table(PGIDENTFILEMAPPINGS_TITLE, PGIDENTFILEMAPPINGS_SQL);
+    PQsetvalue(res, i, 0, orphans[i].path, strlen(orphans[i].path));
+    format_size(value, sizeof(value), orphans[i].size);
+    PQsetvalue(res, i, 1, value, strlen(value));
+    strftime(value, sizeof(value), "%Y-%m-%d %H:%M:%S", localtime(&orphans[i].mtime));
+    PQsetvalue(res, i, 2, value, strlen(value));
+    PQsetvalue(res, i, 3, (char *) orphans[i].dbname, strlen(orphans[i].dbname));
+    pg_free(orphans[i].path);
   }
-  fetch_table(PGSETTINGS_TITLE, PGSETTINGS_SQL);
+  queue_local_section(ORPHANEDFILES_TITLE, res, orphans_duration);
 
-  /* Fetch global objects */
-  printf("\\echo # Global objects\n\n");
-  fetch_table(CLUSTER_HITRATIO_TITLE, CLUSTER_HITRATIO_SQL);
-  fetch_table(CLUSTER_BUFFERSUSAGE_TITLE, CLUSTER_BUFFERSUSAGE_SQL);
-  fetch_table(CLUSTER_BUFFERSUSAGEDIRTY_TITLE, CLUSTER_BUFFERSUSAGEDIRTY_SQL);
-  fetch_table(DATABASES_TITLE, DATABASES_SQL);
-  fetch_table(DATABASES_IN_CACHE_TITLE, DATABASES_IN_CACHE_SQL);
-  fetch_table(TABLESPACES_TITLE, TABLESPACES_SQL);
-  fetch_table(ROLES_TITLE, backend_minimum_version(9,5) ? ROLES_SQL_95min : ROLES_SQL_94max);
-  fetch_table(USER_PASSWORDS_TITLE, USER_PASSWORDS_SQL);
-  fetch_table(DATABASEUSER_CONFIG_TITLE, DATABASEUSER_CONFIG_SQL);
+  /* cleanup */
+  PQclear(res);
+  pg_free(orphans);
+}
 
-  /* Fetch local objects of the current database */
-  if (backend_minimum_version(9,3))
+
+/*
+ * Get the databases of the report with -a, the current one being the first
+ */
+void
+fetch_databases()
+{
+  PGresult *res;
+  int      i;
+
+  res = executeQuery(conn, DATABASES_LIST_SQL, opts->verbose);
+  ndatabases = PQntuples(res) + 1;
+  databases = (char **) pg_malloc(ndatabases * sizeof(char *));
+  databases[0] = pg_strdup(PQdb(conn));
+  for (i = 1; i < ndatabases; i++)
+    databases[i] = pg_strdup(PQgetvalue(res, i - 1, 0));
+  PQclear(res);
+}
+
+
+/*
+ * Execute query, and only warn if it fails
+ */
+bool
+execute_or_warn(char *query)
+{
+  PGresult *res;
+  bool     ok;
+
+  if (opts->verbose)
+    printf("%s\n", query);
+
+  res = PQexec(conn, query);
+  ok = res && PQresultStatus(res) == PGRES_COMMAND_OK;
+  if (!ok)
   {
-    printf("SELECT current_database() AS db \\gset");
-    printf("\\echo # Local objects in database :'db'\n\n");
+    pg_log_warning("query failed in database \"%s\": %s", PQdb(conn), PQerrorMessage(conn));
+    pg_log_info("query was: %s", query);
   }
-  else
+  PQclear(res);
+
+  return ok;
+}
+
+
+/*
+ * statement_timeout of the next query, in milliseconds
+ *
+ * It is the timeout of the sections or the time left in the budget,
+ * whichever is shorter, 0 without both, and -1 if the budget is spent.
+ */
+long
+section_timeout()
+{
+  long timeout = opts->timeout * 1000L;
+
+  if (opts->budget > 0)
   {
-    printf("\\echo # Local objects in current database\n\n");
+    long left = (long) ((report_start + opts->budget - clock_now()) * 1000);
+
+    if (left <= 0)
+      return -1;
+    timeout = timeout > 0 ? Min(timeout, left) : left;
   }
-  fetch_table(SCHEMAS_TITLE, SCHEMAS_SQL);
-  fetch_table(NBRELS_IN_SCHEMA_TITLE, NBRELS_IN_SCHEMA_SQL);
-  if (backend_minimum_version(11,0))
-  {
-    fetch_table(NBFUNCSPROCS_IN_SCHEMA_TITLE,
-          NBFUNCSPROCS_IN_SCHEMA_SQL);
+  return timeout;
+}
+
+
+/*
+ * Create a table read by several sections, with the timeout of a section
+ *
+ * If the query is cancelled, or the budget is spent, the table is created
+ * empty, so that the sections reading it are still executed. Its duration,
+ * summed over the databases with -a, is in the summary, as a setup step.
+ * Inside a transaction, a savepoint keeps the transaction usable after a
+ * cancel. Any other error is returned.
+ */
+bool
+execute_setup(const char *label, char *query)
+{
+  section    *step = NULL;
+  PGresult   *res;
+  char       sql[PGREPORT_DEFAULT_STRING_SIZE];
+  const char *sqlstate;
+  const char *skipped = NULL;
+  bool       intrans;
+  bool       failed;
+  bool       errored = false;
+  double     start;
+  long       timeout;
+  int        i;
+
+  if (!opts->direct)
+  {
+    execute(query);
+    return true;
+  }
+
+  /* the same step in every database */
+  for (i = 0; i < nsetups; i++)
+  {
+    if (strcmp(setups[i].label, label) == 0)
+      step = &setups[i];
+  }
+  if (!step)
+  {
+    Assert(nsetups < lengthof(setups));
+    step = &setups[nsetups++];
+    memset(step, 0, sizeof(section));
+    step->label = label;
+  }
+
+  start = clock_now();
+  timeout = section_timeout();
+  if (timeout < 0)
+    skipped = "budget";
+  else
+  {
+    intrans = PQtransactionStatus(conn) == PQTRANS_INTRANS;
+    if (intrans)
+      executeCommand(conn, "SAVEPOINT pgreport_setup", opts->verbose);
+    if (timeout > 0)
+    {
+      snprintf(sql, sizeof(sql), "SET statement_timeout TO %ld", timeout);
+      executeCommand(conn, sql, opts->verbose);
+    }
+
+    if (opts->verbose)
+      printf("%s\n", query);
+    res = PQexec(conn, query);
+    failed = !res || PQresultStatus(res) != PGRES_COMMAND_OK;
+    if (failed)
+    {
+      sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+      if (sqlstate && strcmp(sqlstate, "57014") == 0)
+        skipped = "timeout";
+      else
+      {
+        pg_log_error("query failed in database \"%s\": %s", PQdb(conn), PQerrorMessage(conn));
+        pg_log_info("query was: %s", query);
+        errored = true;
+        if (!step->error)
+          step->error = pg_strdup(PQerrorMessage(conn));
+      }
+    }
+    else
+      step->ntuples += atoi(PQcmdTuples(res));
+    PQclear(res);
+
+    /* the rollback also cancels the SET */
+    if (failed && intrans)
+      executeCommand(conn, "ROLLBACK TO SAVEPOINT pgreport_setup", opts->verbose);
+    else if (timeout > 0)
+      executeCommand(conn, "RESET statement_timeout", opts->verbose);
+    if (errored)
+    {
+      step->duration += clock_now() - start;
+      return false;
+    }
+  }
+
+  /* only this database goes without the data */
+  step->ndatabases++;
+  if (skipped)
+  {
+    step->skipped = skipped;
+    step->nskipped++;
+    snprintf(sql, sizeof(sql), "%s WITH NO DATA", query);
+    executeCommand(conn, sql, opts->verbose);
+  }
+  step->duration += clock_now() - start;
+  return true;
+}
+
+
+/*
+ * Install our objects in the database of conn, in a single transaction
+ */
+bool
+prepare_database()
+{
+  char sql[PGREPORT_DEFAULT_STRING_SIZE];
+
+  if (!execute_or_warn("BEGIN") ||
+      !execute_or_warn(CREATE_SCHEMA) ||
+      !execute_or_warn(SET_SEARCHPATH))
+    return false;
+  snprintf(sql, sizeof(sql), CREATE_EXTENSION_SQL, "pg_visibility");
+  if (!execute_or_warn(sql) ||
+      !execute_setup(RELATIONS_SETUP_TITLE, CREATE_RELATIONS_TABLE_SQL))
+    return false;
+  if (opts->bloat_topk > 0 && backend_minimum_version(9,5))
+  {
+    snprintf(sql, sizeof(sql), CREATE_EXTENSION_SQL, "pgstattuple");
+    if (!execute_or_warn(sql))
+      return false;
+  }
+  return execute_or_warn(CREATE_GETVALUE_FUNCTION_SQL) &&
+         execute_or_warn("COMMIT");
+}
+
+
+/*
+ * Install our objects in the other databases, as in the current one
+ *
+ * The pg_buffercache snapshot is only needed in the current database, the
+ * temporary views are created by each connection. Each database has its own
+ * snapshot of pg_class. A database where they can't be installed is left
+ * out of the report, the transaction leaving nothing behind in it.
+ */
+void
+prepare_databases(ConnParams *cparams)
+{
+  PGconn *current = conn;
+  int    i = 1;
+
+  while (i < ndatabases)
+  {
+    cparams->override_dbname = databases[i];
+    conn = connectDatabase(cparams, progname, opts->verbose, true, false);
+    if (conn && prepare_database())
+    {
+      if (opts->local)
+        find_orphaned_files(conn);
+      PQfinish(conn);
+      i++;
+      continue;
+    }
+
+    pg_log_warning("skipping database \"%s\"", databases[i]);
+    if (conn)
+      PQfinish(conn);
+    pg_free(databases[i]);
+    ndatabases--;
+    memmove(&databases[i], &databases[i + 1], (ndatabases - i) * sizeof(char *));
+  }
+  cparams->override_dbname = NULL;
+  conn = current;
+}
+
+
+/*
+ * Uninstall our objects from the other databases
+ *
+ * A failure in one database doesn't prevent the cleanup of the next ones.
+ */
+void
+cleanup_databases(ConnParams *cparams)
+{
+  PGconn *current = conn;
+  int    i;
+
+  for (i = 1; i < ndatabases; i++)
+  {
+    cparams->override_dbname = databases[i];
+    conn = connectDatabase(cparams, progname, opts->verbose, true, false);
+    if (!conn)
+    {
+      pg_log_warning("could not connect to database \"%s\" to drop the pgreport schema",
+                     databases[i]);
+      pg_free(databases[i]);
+      continue;
+    }
+    /* without our search_path, the drops could hit objects of the user */
+    if (execute_or_warn(SET_SEARCHPATH))
+    {
+      if (opts->bloat_topk > 0 && backend_minimum_version(9,5))
+        execute_or_warn(DROP_PGSTATTUPLE);
+      execute_or_warn(DROP_DATABASE);
+    }
+    PQfinish(conn);
+    pg_free(databases[i]);
+  }
+  cparams->override_dbname = NULL;
+  conn = current;
+  if (ndatabases > 0)
+    pg_free(databases[0]);
+  pg_free(databases);
+}
+
+
+/*
+ * Current time of a monotonic clock, in seconds
+ */
+double
+clock_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Keep the result of a section, and print the sections that can be
+ *
+ * The slot clears the result itself, so a copy is kept if it can't be
+ * printed yet. With -E, the result of the query is followed by its plan.
+ * With -a, the results of every database are merged, and the section is
+ * done when all its queries are. With the JSON output, the rows come one by
+ * one, followed by an empty result.
+ */
+static bool
+section_result_handler(PGresult *res, PGconn *conn, void *context)
+{
+  task        *t = (task *) context;
+  section     *s = t->section;
+  const char  *sqlstate;
+  bool        finished;
+  int         row;
+
+  /* the statement_timeout set before the query */
+  if (PQresultStatus(res) == PGRES_COMMAND_OK)
+    return true;
+
+  /* a row of the query, in single-row mode */
+  if (PQresultStatus(res) == PGRES_SINGLE_TUPLE && !t->received)
+  {
+    merge_result(s, res);
+    return true;
+  }
+
+  /* the result of the query */
+  if (!t->received)
+  {
+    t->received = true;
+    s->duration += clock_now() - t->start;
+    sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    if (sqlstate && strcmp(sqlstate, "57014") == 0)
+    {
+      s->skipped = "timeout";
+      t->failed = true;
+    }
+    else if (PQresultStatus(res) == PGRES_TUPLES_OK)
+      merge_result(s, res);
+    else
+    {
+      /* the first error is enough */
+      if (!s->error && s->perdb)
+        s->error = psprintf("database %s: %s", t->dbname, PQerrorMessage(conn));
+      else if (!s->error)
+        s->error = pg_strdup(PQerrorMessage(conn));
+      t->failed = true;
+    }
+
+    /* the plan isn't executed if the query failed */
+    finished = !opts->explain || t->failed;
+  }
+
+  /* its plan, one line per row */
+  else
+  {
+    if (PQresultStatus(res) == PGRES_TUPLES_OK ||
+        PQresultStatus(res) == PGRES_SINGLE_TUPLE)
+    {
+      if (s->plan == NULL)
+        s->plan = createPQExpBuffer();
+      if (s->perdb && !t->explained)
+        appendPQExpBuffer(s->plan, "Database %s:\n", t->dbname);
+      t->explained = true;
+      for (row = 0; row < PQntuples(res); row++)
+        appendPQExpBuffer(s->plan, "%s\n", PQgetvalue(res, row, 0));
+    }
+    finished = PQresultStatus(res) != PGRES_SINGLE_TUPLE;
+  }
+
+  if (finished && --s->pending == 0)
+  {
+    s->done = true;
+    print_ready_sections();
+  }
+
+  return true;
+}
+
+
+/*
+ * Add the rows of a result to the ones of its section
+ */
+void
+merge_result(section *s, PGresult *res)
+{
+  int row;
+  int col;
+
+  for (row = 0; row < PQntuples(res); row++)
+    for (col = 0; col < PQnfields(res); col++)
+      s->bytes += PQgetlength(res, row, col);
+
+  /* the JSON rows are printed, or kept already formatted */
+  if (opts->output == OUTPUT_JSON)
+  {
+    if (s->result == NULL)
+      s->result = PQcopyResult(res, PG_COPYRES_ATTRS);
+    json_rows(s, res);
+    return;
+  }
+
+  if (s->result == NULL)
+    s->result = PQcopyResult(res, PG_COPYRES_ATTRS | PG_COPYRES_TUPLES);
+  else
+  {
+    for (row = 0; row < PQntuples(res); row++)
+      for (col = 0; col < PQnfields(res); col++)
+        PQsetvalue(s->result, s->ntuples + row, col, PQgetvalue(res, row, col),
+          PQgetisnull(res, row, col) ? -1 : PQgetlength(res, row, col));
+  }
+  s->ntuples = PQntuples(s->result);
+}
+
+
+/*
+ * Get the queries of the sections, in the order in which they are executed
+ *
+ * Without a time budget, the expensive sections go first, so that the
+ * report ends as soon as possible. With a time budget, the cheap sections go
+ * first, so that most sections are in the report if the budget is too
+ * short. With -a, the queries of a database follow each other, so that the
+ * connections are reused rather than opened again.
+ */
+task *
+schedule_tasks(int *ntasks)
+{
+  task *tasks;
+  int  n = 0;
+  int  pass;
+  int  db;
+  int  i;
+
+  tasks = (task *) pg_malloc0((nsections * Max(ndatabases, 1) + 1) * sizeof(task));
+  for (pass = 0; pass < 2; pass++)
+  {
+    bool expensive = (pass == 0) == (opts->budget == 0);
+
+    for (db = 0; db < Max(ndatabases, 1); db++)
+    {
+      for (i = 0; i < nsections; i++)
+      {
+        if (sections[i].done || sections[i].expensive != expensive ||
+            (db > 0 && !sections[i].perdb))
+          continue;
+        tasks[n].section = &sections[i];
+        tasks[n].dbname = opts->alldbs ? databases[db] : NULL;
+        sections[i].pending++;
+        n++;
+      }
+    }
+  }
+
+  *ntasks = n;
+  return tasks;
+}
+
+
+/*
+ * Execute the queued sections on a pool of connections, and print them in
+ * the order of the report
+ *
+ * Every section is independent from the others, so they're sent to the
+ * first idle connection. The ones that end before the previous sections are
+ * kept till they can be printed. With -a, the sections of the local objects
+ * are executed in every database, with the name of the database as their
+ * first column, and the other ones in the current database.
+ *
+ * Each query gets a statement_timeout, being the timeout of the sections or
+ * the time left in the budget, whichever is shorter. The sections that can't
+ * start before the end of the budget are skipped.
+ */
+void
+run_sections(ConnParams *cparams)
+{
+  ParallelSlot *slot;
+  PQExpBuffer  sql;
+  PQExpBuffer  query;
+  section      *s;
+  task         *tasks;
+  task         *t;
+  int          ntasks;
+  long         timeout;
+  int          i;
+
+  /*
+   * every new connection gets the session settings and temporary objects,
+   * the current one already has them
+   */
+  slots = ParallelSlotsSetup(opts->jobs, cparams, progname, opts->verbose,
+    initcmd->data);
+  ParallelSlotsAdoptConn(slots, conn);
+  conn = NULL;
+
+  tasks = schedule_tasks(&ntasks);
+  for (i = 0; i < ntasks; i++)
+  {
+    t = &tasks[i];
+    s = t->section;
+
+    slot = ParallelSlotsGetIdle(slots, t->dbname);
+    if (!slot)
+    {
+      ParallelSlotsTerminate(slots);
+      exit(EXIT_FAILURE);
+    }
+
+    /* time left for this section */
+    timeout = section_timeout();
+    if (timeout < 0)
+    {
+      s->skipped = "budget";
+      if (--s->pending == 0)
+      {
+        s->done = true;
+        print_ready_sections();
+      }
+      continue;
+    }
+
+    if (opts->verbose)
+      pg_log_info("executing section \"%s\"%s%s", s->label,
+        s->perdb ? " in database " : "", s->perdb ? t->dbname : "");
+
+    /* the rows of every database are merged, so they're labeled */
+    sql = createPQExpBuffer();
+    if (s->perdb)
+    {
+      int len = strlen(s->query);
+
+      while (len > 0 && s->query[len - 1] == ';')
+        len--;
+      appendPQExpBuffer(sql, "SELECT current_database() AS datname, * FROM (%.*s) s",
+        len, s->query);
+    }
+    else
+      appendPQExpBufferStr(sql, s->query);
+
+    /* with -E, the query is executed a second time to get its plan */
+    query = createPQExpBuffer();
+    if (timeout > 0)
+      appendPQExpBuffer(query, "SET statement_timeout TO %ld;\n", timeout);
+    appendPQExpBufferStr(query, sql->data);
+    if (opts->explain)
+      appendPQExpBuffer(query, ";\nEXPLAIN (ANALYZE, BUFFERS) %s", sql->data);
+
+    ParallelSlotSetHandler(slot, section_result_handler, t);
+    t->start = clock_now();
+    if (!PQsendQuery(slot->connection, query->data))
+    {
+      pg_log_error("query failed: %s", PQerrorMessage(slot->connection));
+      pg_log_info("query was: %s", query->data);
+      ParallelSlotsTerminate(slots);
+      exit(EXIT_FAILURE);
+    }
+
+    /* the JSON rows don't need the whole result */
+    if (opts->output == OUTPUT_JSON)
+      PQsetSingleRowMode(slot->connection);
+    destroyPQExpBuffer(sql);
+    destroyPQExpBuffer(query);
+  }
+
+  if (!ParallelSlotsWaitCompletion(slots))
+  {
+    ParallelSlotsTerminate(slots);
+    exit(EXIT_FAILURE);
+  }
+
+  /* the cleanup needs a connection to the current database, without a timeout */
+  slot = ParallelSlotsGetIdle(slots, opts->alldbs ? databases[0] : NULL);
+  if (!slot)
+  {
+    ParallelSlotsTerminate(slots);
+    exit(EXIT_FAILURE);
+  }
+  conn = slot->connection;
+  if (opts->timeout > 0 || opts->budget > 0)
+    executeCommand(conn, "RESET statement_timeout", opts->verbose);
+
+  /* cleanup */
+  pg_free(tasks);
+}
+
+
+/*
+ * Print the sections that are done, as long as the previous ones are
+ * printed
+ *
+ * With the JSON output, the first section that isn't printed yet is opened
+ * as soon as it has rows, and its next rows are printed as they come.
+ */
+void
+print_ready_sections()
+{
+  section *s;
+
+  if (opts->output == OUTPUT_JSON)
+  {
+    while (nprinted < nsections)
+    {
+      s = &sections[nprinted];
+      if (!s->opened && (s->done || s->result))
+        json_open_section(s);
+      if (!s->done)
+        break;
+      json_close_section(s);
+      nprinted++;
+    }
+    fflush(stdout);
+    return;
+  }
+
+  while (nprinted < nsections && sections[nprinted].done)
+  {
+    s = &sections[nprinted++];
+
+    if (s->heading)
+      printf("# %s\n\n", s->heading);
+    printf("%s\n", s->label);
+    if (s->skipped)
+      printf("skipped (%s)\n\n", s->skipped);
+    else if (s->error)
+    {
+      pg_log_error("section \"%s\" failed: %s", s->label, s->error);
+      printf("\n");
+    }
+    else
+      print_result(s->result);
+    if (s->plan)
+      printf("%s\n", s->plan->data);
+    fflush(stdout);
+
+    /* cleanup, the error being kept for the summary */
+    PQclear(s->result);
+    if (s->plan)
+      destroyPQExpBuffer(s->plan);
+    s->result = NULL;
+    s->plan = NULL;
+  }
+}
+
+
+/*
+ * Append a string to a buffer, as a JSON string
+ */
+void
+json_string(PQExpBuffer buf, const char *str)
+{
+  appendPQExpBufferChar(buf, '"');
+  for (; *str; str++)
+  {
+    switch (*str)
+    {
+      case '"':
+        appendPQExpBufferStr(buf, "\\\"");
+        break;
+      case '\\':
+        appendPQExpBufferStr(buf, "\\\\");
+        break;
+      case '\n':
+        appendPQExpBufferStr(buf, "\\n");
+        break;
+      case '\r':
+        appendPQExpBufferStr(buf, "\\r");
+        break;
+      case '\t':
+        appendPQExpBufferStr(buf, "\\t");
+        break;
+      default:
+        if ((unsigned char) *str < 0x20)
+          appendPQExpBuffer(buf, "\\u%04x", *str);
+        else
+          appendPQExpBufferChar(buf, *str);
+    }
+  }
+  appendPQExpBufferChar(buf, '"');
+}
+
+
+/*
+ * JSON type of the values of a PostgreSQL type
+ */
+const char *
+json_type(Oid type)
+{
+  if (type == BOOLOID)
+    return "boolean";
+  if (type == INT2OID || type == INT4OID || type == INT8OID ||
+      type == OIDOID || type == FLOAT4OID || type == FLOAT8OID ||
+      type == NUMERICOID)
+    return "number";
+  return "string";
+}
+
+
+/*
+ * Print the rows of a result as JSON arrays, or keep them if the section
+ * can't be printed yet
+ *
+ * The numbers and booleans are typed, NULL is null, and everything else is a
+ * string.
+ */
+void
+json_rows(section *s, PGresult *res)
+{
+  PQExpBuffer buf = createPQExpBuffer();
+  int         row;
+  int         col;
+
+  for (row = 0; row < PQntuples(res); row++)
+  {
+    appendPQExpBufferStr(buf, s->ntuples++ > 0 ? ",\n        [" : "\n        [");
+    for (col = 0; col < PQnfields(res); col++)
+    {
+      const char *value = PQgetvalue(res, row, col);
+      const char *type = json_type(PQftype(res, col));
+
+      if (col > 0)
+        appendPQExpBufferStr(buf, ", ");
+      if (PQgetisnull(res, row, col))
+        appendPQExpBufferStr(buf, "null");
+      else if (strcmp(type, "boolean") == 0)
+        appendPQExpBufferStr(buf, value[0] == 't' ? "true" : "false");
+      /* NaN and Infinity aren't JSON numbers */
+      else if (strcmp(type, "number") == 0 && strpbrk(value, "IiNn") == NULL)
+        appendPQExpBufferStr(buf, value);
+      else
+        json_string(buf, value);
+    }
+    appendPQExpBufferChar(buf, ']');
+  }
+
+  if (s == &sections[nprinted] && !s->opened)
+    json_open_section(s);
+  if (s->opened)
+    fputs(buf->data, stdout);
+  else
+  {
+    if (s->rows == NULL)
+      s->rows = createPQExpBuffer();
+    appendPQExpBufferStr(s->rows, buf->data);
+  }
+  destroyPQExpBuffer(buf);
+}
+
+
+/*
+ * Print the beginning of a JSON section, till its first rows
+ */
+void
+json_open_section(section *s)
+{
+  PQExpBuffer buf = createPQExpBuffer();
+  int         col;
+
+  if (s->heading)
+    current_part = s->heading;
+  appendPQExpBufferStr(buf, nprinted > 0 ? ",\n    {\n      \"part\": " : "\n    {\n      \"part\": ");
+  json_string(buf, current_part ? current_part : "");
+  appendPQExpBufferStr(buf, ",\n      \"title\": ");
+  json_string(buf, s->label);
+  appendPQExpBufferStr(buf, ",\n      \"columns\": [");
+  for (col = 0; s->result && col < PQnfields(s->result); col++)
+  {
+    appendPQExpBufferStr(buf, col > 0 ? ", {\"name\": " : "{\"name\": ");
+    json_string(buf, PQfname(s->result, col));
+    appendPQExpBuffer(buf, ", \"type\": \"%s\"}", json_type(PQftype(s->result, col)));
+  }
+  appendPQExpBufferStr(buf, "],\n      \"rows\": [");
+  fputs(buf->data, stdout);
+  destroyPQExpBuffer(buf);
+
+  if (s->rows)
+  {
+    fputs(s->rows->data, stdout);
+    destroyPQExpBuffer(s->rows);
+    s->rows = NULL;
+  }
+  s->opened = true;
+}
+
+
+/*
+ * Print the end of a JSON section, with its status and its cost
+ */
+void
+json_close_section(section *s)
+{
+  PQExpBuffer buf = createPQExpBuffer();
+
+  appendPQExpBufferStr(buf, s->ntuples > 0 ? "\n      ],\n" : "],\n");
+  if (s->skipped)
+    appendPQExpBuffer(buf, "      \"status\": \"skipped (%s)\",\n", s->skipped);
+  else if (s->error)
+  {
+    appendPQExpBufferStr(buf, "      \"status\": \"failed\",\n      \"error\": ");
+    json_string(buf, s->error);
+    appendPQExpBufferStr(buf, ",\n");
+  }
+  else
+    appendPQExpBufferStr(buf, "      \"status\": \"ok\",\n");
+  if (s->plan)
+  {
+    appendPQExpBufferStr(buf, "      \"plan\": ");
+    json_string(buf, s->plan->data);
+    appendPQExpBufferStr(buf, ",\n");
+  }
+  appendPQExpBuffer(buf, "      \"duration_ms\": %.3f,\n      \"rows_count\": %d,\n      \"bytes\": %ld\n    }",
+    s->duration * 1000, s->ntuples, s->bytes);
+  fputs(buf->data, stdout);
+  destroyPQExpBuffer(buf);
+
+  /* cleanup, the error being kept for the summary */
+  PQclear(s->result);
+  if (s->plan)
+    destroyPQExpBuffer(s->plan);
+  s->result = NULL;
+  s->plan = NULL;
+}
+
+
+/*
+ * Order sections by decreasing duration
+ */
+static int
+compare_sections(const void *a, const void *b)
+{
+  const section *sa = *(const section * const *) a;
+  const section *sb = *(const section * const *) b;
+
+  if (sa->duration != sb->duration)
+    return sa->duration > sb->duration ? -1 : 1;
+  return 0;
+}
+
+
+/*
+ * Print the cost of each section, the slowest first
+ */
+void
+print_summary()
+{
+  PGresult     *res;
+  PGresAttDesc attrs[5];
+  section      **sorted;
+  char         value[64];
+  double       total = 0;
+  double       setup = 0;
+  int          i;
+
+  /* with the JSON output, the cost of each section is in the section */
+  if (opts->output == OUTPUT_JSON)
+  {
+    for (i = 0; i < nsections; i++)
+      total += sections[i].duration;
+    for (i = 0; i < nsetups; i++)
+      setup += setups[i].duration;
+    printf("\n  ],\n  \"duration\": %.3f,\n  \"setup_duration\": %.3f,\n  \"sections_duration\": %.3f,\n  \"connections\": %d\n}\n",
+      clock_now() - report_start, setup, total, opts->jobs);
+    return;
+  }
+
+  /* the setup steps come with the sections */
+  sorted = (section **) pg_malloc((nsections + nsetups + 1) * sizeof(section *));
+  for (i = 0; i < nsections; i++)
+    sorted[i] = &sections[i];
+  for (i = 0; i < nsetups; i++)
+    sorted[nsections + i] = &setups[i];
+  qsort(sorted, nsections + nsetups, sizeof(section *), compare_sections);
+
+  /* build a result, to print it as the other sections */
+  memset(attrs, 0, sizeof(attrs));
+  attrs[0].name = "Section";
+  attrs[0].typid = TEXTOID;
+  attrs[1].name = "Duration (ms)";
+  attrs[1].typid = NUMERICOID;
+  attrs[2].name = "Rows";
+  attrs[2].typid = INT4OID;
+  attrs[3].name = "Bytes";
+  attrs[3].typid = INT8OID;
+  attrs[4].name = "Status";
+  attrs[4].typid = TEXTOID;
+  res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+  PQsetResultAttrs(res, lengthof(attrs), attrs);
+
+  for (i = 0; i < nsections + nsetups; i++)
+  {
+    PQsetvalue(res, i, 0, (char *) sorted[i]->label, strlen(sorted[i]->label));
+    snprintf(value, sizeof(value), "%.3f", sorted[i]->duration * 1000);
+    PQsetvalue(res, i, 1, value, strlen(value));
+    snprintf(value, sizeof(value), "%d", sorted[i]->ntuples);
+    PQsetvalue(res, i, 2, value, strlen(value));
+    snprintf(value, sizeof(value), "%ld", sorted[i]->bytes);
+    PQsetvalue(res, i, 3, value, strlen(value));
+    if (sorted[i]->skipped && sorted[i]->nskipped < sorted[i]->ndatabases)
+      snprintf(value, sizeof(value), "skipped (%s) in %d of %d databases",
+               sorted[i]->skipped, sorted[i]->nskipped, sorted[i]->ndatabases);
+    else if (sorted[i]->skipped)
+      snprintf(value, sizeof(value), "skipped (%s)", sorted[i]->skipped);
+    else
+      strlcpy(value, sorted[i]->error ? "failed" : "ok", sizeof(value));
+    PQsetvalue(res, i, 4, value, strlen(value));
+  }
+  for (i = 0; i < nsections; i++)
+    total += sections[i].duration;
+  for (i = 0; i < nsetups; i++)
+    setup += setups[i].duration;
+
+  printf("# Sections\n\n");
+  print_result(res);
+  printf("Report duration: %.3fs, setup duration: %.3fs, sections duration: %.3fs, on %d connections\n",
+    clock_now() - report_start, setup, total, opts->jobs);
+
+  /* cleanup */
+  PQclear(res);
+  pg_free(sorted);
+}
+
+
+/*
+ * Number of characters of a UTF-8 string
+ */
+int
+display_width(const char *str)
+{
+  int width = 0;
+
+  for (; *str; str++)
+  {
+    if ((*str & 0xC0) != 0x80)
+      width++;
+  }
+  return width;
+}
+
+
+/*
+ * Print a cell of a table, padded to the width of its column
+ */
+void
+print_cell(const char *str, int width, bool right, bool last)
+{
+  int pad = width - display_width(str);
+
+  if (right)
+    printf(" %*s%s%s", pad, "", str, last ? "" : " ");
+  else if (last)
+    printf(" %s", str);
+  else
+    printf(" %s%*s ", str, pad, "");
+}
+
+
+/*
+ * Print a result as an aligned table, as psql does
+ */
+void
+print_result(PGresult *res)
+{
+  int  nfields = PQnfields(res);
+  int  ntuples = PQntuples(res);
+  int  *widths;
+  bool *right;
+  int  row;
+  int  col;
+
+  /* width of each column, and its alignment */
+  widths = (int *) pg_malloc0((nfields + 1) * sizeof(int));
+  right = (bool *) pg_malloc0((nfields + 1) * sizeof(bool));
+  for (col = 0; col < nfields; col++)
+  {
+    Oid type = PQftype(res, col);
+
+    right[col] = type == INT2OID || type == INT4OID || type == INT8OID ||
+                 type == OIDOID || type == XIDOID || type == FLOAT4OID ||
+                 type == FLOAT8OID || type == NUMERICOID;
+    widths[col] = display_width(PQfname(res, col));
+    for (row = 0; row < ntuples; row++)
+      widths[col] = Max(widths[col], display_width(PQgetvalue(res, row, col)));
+  }
+
+  /* centered headers */
+  for (col = 0; col < nfields; col++)
+  {
+    int pad = widths[col] - display_width(PQfname(res, col));
+
+    printf("%s %*s%s%*s%s", col > 0 ? "|" : "",
+      pad / 2, "", PQfname(res, col),
+      col < nfields - 1 ? pad - pad / 2 : 0, "",
+      col < nfields - 1 ? " " : "");
+  }
+  printf("\n");
+  for (col = 0; col < nfields; col++)
+  {
+    printf("%s", col > 0 ? "+" : "");
+    for (row = 0; row < widths[col] + 2; row++)
+      printf("-");
+  }
+  printf("\n");
+
+  /* rows */
+  for (row = 0; row < ntuples; row++)
+  {
+    for (col = 0; col < nfields; col++)
+    {
+      printf("%s", col > 0 ? "|" : "");
+      print_cell(PQgetvalue(res, row, col), widths[col], right[col], col == nfields - 1);
+    }
+    printf("\n");
+  }
+  printf("(%d row%s)\n\n", ntuples, ntuples == 1 ? "" : "s");
+
+  /* cleanup */
+  pg_free(widths);
+  pg_free(right);
+}
+
+
+/*
+ * Order capture lines by category, then key
+ *
+ * The fields can't contain tabs, so the key of a line ends at its second
+ * tab. The captures are written and merged in this order.
+ */
+static int
+compare_capture_keys(const void *a, const void *b)
+{
+  const char *la = *(const char * const *) a;
+  const char *lb = *(const char * const *) b;
+  const char *ea = strchr(la, '\t');
+  const char *eb = strchr(lb, '\t');
+  size_t     na;
+  size_t     nb;
+  int        cmp;
+
+  ea = ea ? strchr(ea + 1, '\t') : NULL;
+  eb = eb ? strchr(eb + 1, '\t') : NULL;
+  na = ea ? ea - la : strlen(la);
+  nb = eb ? eb - lb : strlen(lb);
+  cmp = memcmp(la, lb, Min(na, nb));
+  if (cmp != 0)
+    return cmp;
+  return na < nb ? -1 : na > nb ? 1 : 0;
+}
+
+
+/*
+ * Escape the tabs, newlines and backslashes of a capture field
+ */
+char *
+capture_escape(const char *str)
+{
+  PQExpBuffer buf = createPQExpBuffer();
+  char        *escaped;
+
+  for (; *str; str++)
+  {
+    if (*str == '\t')
+      appendPQExpBufferStr(buf, "\\t");
+    else if (*str == '\n')
+      appendPQExpBufferStr(buf, "\\n");
+    else if (*str == '\r')
+      appendPQExpBufferStr(buf, "\\r");
+    else if (*str == '\\')
+      appendPQExpBufferStr(buf, "\\\\");
+    else
+      appendPQExpBufferChar(buf, *str);
+  }
+  escaped = pg_strdup(buf->data);
+  destroyPQExpBuffer(buf);
+  return escaped;
+}
+
+
+/*
+ * Save the capture of the report, to compare it later with another one
+ *
+ * A capture is a TSV file with a line per key (category, key, value,
+ * detail): the bloat of each table and index, the scans of each index, the
+ * size and kind of each relation, and the value of each setting. The lines
+ * are sorted on their keys, so that two captures are compared in a single
+ * pass, whatever their size.
+ */
+void
+write_capture(const char *filename)
+{
+  char     tmpfilename[MAXPGPATH];
+  PGresult *res;
+  char     **lines;
+  FILE     *fd;
+  int      row;
+  int      col;
+
+  res = executeQuery(conn, CAPTURE_SQL, opts->verbose);
+  lines = (char **) pg_malloc((PQntuples(res) + 1) * sizeof(char *));
+  for (row = 0; row < PQntuples(res); row++)
+  {
+    PQExpBuffer line = createPQExpBuffer();
+
+    for (col = 0; col < 4; col++)
+    {
+      char *field = capture_escape(PQgetvalue(res, row, col));
+
+      appendPQExpBuffer(line, "%s%s", col > 0 ? "\t" : "", field);
+      pg_free(field);
+    }
+    lines[row] = pg_strdup(line->data);
+    destroyPQExpBuffer(line);
+  }
+  qsort(lines, PQntuples(res), sizeof(char *), compare_capture_keys);
+
+  /* written under a temporary name, so that a capture is never partial */
+  snprintf(tmpfilename, sizeof(tmpfilename), "%s.tmp", filename);
+  fd = fopen(tmpfilename, "w");
+  if (!fd)
+  {
+    pg_log_error("Cannot open file %s, errno %d\n", tmpfilename, errno);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(fd, "# pgreport " PGREPORT_VERSION " capture of database %s\n", PQdb(conn));
+  for (row = 0; row < PQntuples(res); row++)
+  {
+    fprintf(fd, "%s\n", lines[row]);
+    pg_free(lines[row]);
+  }
+  if (fclose(fd) != 0 || rename(tmpfilename, filename) != 0)
+  {
+    pg_log_error("Cannot write file %s, errno %d\n", filename, errno);
+    exit(EXIT_FAILURE);
+  }
+
+  /* cleanup */
+  pg_free(lines);
+  PQclear(res);
+}
+
+
+/*
+ * Open a capture, and read its first line
+ */
+void
+capture_open(capture *c, const char *filename)
+{
+  memset(c, 0, sizeof(capture));
+  c->filename = filename;
+  c->fd = fopen(filename, "r");
+  if (!c->fd)
+  {
+    pg_log_error("Cannot open file %s, errno %d\n", filename, errno);
+    exit(EXIT_FAILURE);
+  }
+  capture_next(c);
+}
+
+
+/*
+ * Read the next line of a capture, and split it in its fields
+ *
+ * The order of the lines is checked, as the comparison depends on it.
+ */
+void
+capture_next(capture *c)
+{
+  char    *previous = c->line ? pg_strdup(c->line) : NULL;
+  ssize_t len;
+  int     i;
+
+  do
+  {
+    len = getline(&c->line, &c->size, c->fd);
+  } while (len >= 0 && c->line[0] == '#');
+
+  if (len < 0)
+  {
+    c->eof = true;
+    fclose(c->fd);
+    free(c->line);
+    c->line = NULL;
+    pg_free(previous);
+    return;
+  }
+  if (len > 0 && c->line[len - 1] == '\n')
+    c->line[len - 1] = '\0';
+
+  if (previous && compare_capture_keys(&previous, &c->line) >= 0)
+  {
+    pg_log_error("File %s is not a pgreport capture, its lines aren't sorted.\n",
+      c->filename);
+    exit(EXIT_FAILURE);
+  }
+  pg_free(previous);
+
+  /* the fields point in a copy of the line, the line itself is compared */
+  pg_free(c->fields[0]);
+  c->fields[0] = pg_strdup(c->line);
+  for (i = 1; i < lengthof(c->fields); i++)
+  {
+    c->fields[i] = c->fields[i - 1] ? strchr(c->fields[i - 1], '\t') : NULL;
+    if (c->fields[i])
+      *c->fields[i]++ = '\0';
+  }
+  for (i = 1; i < lengthof(c->fields); i++)
+  {
+    if (c->fields[i] == NULL)
+      c->fields[i] = "";
+  }
+}
+
+
+/*
+ * Format a size as pg_size_pretty() does
+ */
+void
+format_size(char *buf, size_t size, long long bytes)
+{
+  const char *units[] = {"bytes", "kB", "MB", "GB", "TB", "PB"};
+  long long  value = bytes;
+  int        unit = 0;
+
+  while (unit < lengthof(units) - 1 && (value < 0 ? -value : value) >= 10 * 1024)
+  {
+    value = (value + (value < 0 ? -512 : 512)) / 1024;
+    unit++;
+  }
+  snprintf(buf, size, "%lld %s", value, units[unit]);
+}
+
+
+/*
+ * Order bloat growths, the biggest first
+ */
+static int
+compare_bloat_growths(const void *a, const void *b)
+{
+  const bloat_growth *ga = (const bloat_growth *) a;
+  const bloat_growth *gb = (const bloat_growth *) b;
+  long long          da = ga->after - ga->before;
+  long long          db = gb->after - gb->before;
+
+  if (da != db)
+    return da > db ? -1 : 1;
+  return strcmp(ga->name, gb->name);
+}
+
+
+/*
+ * Compare two captures, and print what changed between them
+ *
+ * Both captures are sorted on their keys, so they're merged line by line,
+ * as a merge join would do. Only the differences are kept in memory.
+ */
+void
+print_diff()
+{
+  capture      before;
+  capture      after;
+  bloat_growth *growths = NULL;
+  int          ngrowths = 0;
+  int          maxgrowths = 0;
+  long long    kinds[256][2];
+  PGresult     *unused;
+  PGresult     *settings;
+  PGresult     *res;
+  PGresAttDesc attrs[4];
+  char         value[64];
+  int          i;
+
+  memset(kinds, 0, sizeof(kinds));
+  memset(attrs, 0, sizeof(attrs));
+  attrs[0].name = "Index";
+  attrs[0].typid = TEXTOID;
+  attrs[1].name = "Scans";
+  attrs[1].typid = INT8OID;
+  unused = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+  PQsetResultAttrs(unused, 2, attrs);
+  attrs[0].name = "Setting";
+  attrs[1].name = "Before";
+  attrs[1].typid = TEXTOID;
+  attrs[2].name = "After";
+  attrs[2].typid = TEXTOID;
+  settings = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+  PQsetResultAttrs(settings, 3, attrs);
+
+  capture_open(&before, opts->diff[0]);
+  capture_open(&after, opts->diff[1]);
+  while (!before.eof || !after.eof)
+  {
+    int        cmp;
+    char       **b;
+    char       **a;
+    const char *category;
+
+    if (before.eof)
+      cmp = 1;
+    else if (after.eof)
+      cmp = -1;
+    else
+      cmp = compare_capture_keys(&before.line, &after.line);
+    b = cmp <= 0 ? before.fields : NULL;
+    a = cmp >= 0 ? after.fields : NULL;
+    category = b ? b[0] : a[0];
+
+    /* tables and indexes with more bloat */
+    if (strcmp(category, "bloat") == 0 && a && atoll(a[2]) > (b ? atoll(b[2]) : 0))
+    {
+      if (ngrowths == maxgrowths)
+      {
+        maxgrowths = maxgrowths > 0 ? maxgrowths * 2 : 64;
+        growths = (bloat_growth *) pg_realloc(growths, maxgrowths * sizeof(bloat_growth));
+      }
+      growths[ngrowths].name = pg_strdup(a[1]);
+      growths[ngrowths].kind = pg_strdup(a[3]);
+      growths[ngrowths].before = b ? atoll(b[2]) : 0;
+      growths[ngrowths].after = atoll(a[2]);
+      ngrowths++;
+    }
+
+    /* indexes scanned before the first capture, but not since */
+    else if (strcmp(category, "index") == 0 && a && b && strcmp(a[3], "unique") != 0 &&
+             atoll(b[2]) > 0 && atoll(a[2]) == atoll(b[2]))
+    {
+      i = PQntuples(unused);
+      PQsetvalue(unused, i, 0, a[1], strlen(a[1]));
+      PQsetvalue(unused, i, 1, a[2], strlen(a[2]));
+    }
+
+    /* size of each kind of relation */
+    else if (strcmp(category, "relation") == 0)
+    {
+      if (b)
+        kinds[(unsigned char) b[3][0]][0] += atoll(b[2]);
+      if (a)
+        kinds[(unsigned char) a[3][0]][1] += atoll(a[2]);
+    }
+
+    /* settings added, removed or changed */
+    else if (strcmp(category, "setting") == 0 && (!a || !b || strcmp(a[2], b[2]) != 0))
+    {
+      i = PQntuples(settings);
+      PQsetvalue(settings, i, 0, a ? a[1] : b[1],
+        strlen(a ? a[1] : b[1]));
+      PQsetvalue(settings, i, 1, b ? b[2] : NULL, b ? strlen(b[2]) : -1);
+      PQsetvalue(settings, i, 2, a ? a[2] : NULL, a ? strlen(a[2]) : -1);
+    }
+
+    if (b)
+      capture_next(&before);
+    if (a)
+      capture_next(&after);
+  }
+
+  printf("=================================================================================\n");
+  printf("== pgreport differences between %s and %s\n", opts->diff[0], opts->diff[1]);
+  printf("=================================================================================\n");
+
+  /* the biggest bloat growths */
+  qsort(growths, ngrowths, sizeof(bloat_growth), compare_bloat_growths);
+  attrs[0].name = "Relation";
+  attrs[1].name = "Kind";
+  attrs[2].name = "Bloat before";
+  attrs[3].name = "Bloat after";
+  attrs[3].typid = TEXTOID;
+  res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+  PQsetResultAttrs(res, 4, attrs);
+  for (i = 0; i < ngrowths; i++)
+  {
+    if (i < PGREPORT_DEFAULT_LINES)
+    {
+      PQsetvalue(res, i, 0, growths[i].name, strlen(growths[i].name));
+      PQsetvalue(res, i, 1, growths[i].kind, strlen(growths[i].kind));
+      format_size(value, sizeof(value), growths[i].before);
+      PQsetvalue(res, i, 2, value, strlen(value));
+      format_size(value, sizeof(value), growths[i].after);
+      PQsetvalue(res, i, 3, value, strlen(value));
+    }
+    pg_free(growths[i].name);
+    pg_free(growths[i].kind);
+  }
+  printf("# Bloat\n\n");
+  printf("Top %d tables and indexes with more bloat\n", PGREPORT_DEFAULT_LINES);
+  print_result(res);
+  PQclear(res);
+
+  printf("# Indexes\n\n");
+  printf("Indexes not used since the first capture\n");
+  print_result(unused);
+
+  printf("# Configuration\n\n");
+  printf("Settings changed\n");
+  print_result(settings);
+
+  /* the size of each kind of relation */
+  attrs[0].name = "Kind";
+  attrs[1].name = "Size before";
+  attrs[2].name = "Size after";
+  attrs[3].name = "Growth";
+  res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+  PQsetResultAttrs(res, 4, attrs);
+  for (i = 0; i < lengthof(kinds); i++)
+  {
+    int row = PQntuples(res);
+
+    if (kinds[i][0] == 0 && kinds[i][1] == 0)
+      continue;
+    snprintf(value, sizeof(value), "%c", i);
+    PQsetvalue(res, row, 0, value, strlen(value));
+    format_size(value, sizeof(value), kinds[i][0]);
+    PQsetvalue(res, row, 1, value, strlen(value));
+    format_size(value, sizeof(value), kinds[i][1]);
+    PQsetvalue(res, row, 2, value, strlen(value));
+    format_size(value, sizeof(value), kinds[i][1] - kinds[i][0]);
+    PQsetvalue(res, row, 3, value, strlen(value));
+  }
+  printf("# Sizes\n\n");
+  printf("Size of each kind of relation\n");
+  print_result(res);
+
+  /* cleanup */
+  PQclear(res);
+  PQclear(unused);
+  PQclear(settings);
+  pg_free(growths);
+  pg_free(before.fields[0]);
+  pg_free(after.fields[0]);
+}
+
+
+/*
+ * Close the PostgreSQL connection, and quit
+ */
+static void
+quit_properly(SIGNAL_ARGS)
+{
+  exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Main function
+ */
+int
+main(int argc, char **argv)
+{
+  char       sql[10240];
+  char       heading[PGREPORT_DEFAULT_STRING_SIZE];
+  ConnParams cparams;
+
+  /*
+   * If the user stops the program,
+   * quit nicely.
+   */
+  pqsignal(SIGINT, quit_properly);
+
+  /* Initialize the logging interface */
+  pg_logging_init(argv[0]);
+
+  /* Get the program name */
+  progname = get_progname(argv[0]);
+
+  /* Allocate the options struct */
+  opts = (struct options *) pg_malloc(sizeof(struct options));
+
+  /* Parse the options */
+  get_opts(argc, argv);
+
+  /* Compare two captures, without connecting */
+  if (opts->ndiffs == 2)
+  {
+    print_diff();
+    pg_free(opts);
+    return 0;
+  }
+
+  if (opts->direct)
+  {
+    /* Set the connection struct */
+    cparams.pghost = opts->hostname;
+    cparams.pgport = opts->port;
+    cparams.pguser = opts->username;
+    cparams.dbname = opts->dbname;
+    cparams.prompt_password = TRI_DEFAULT;
+    cparams.override_dbname = NULL;
+
+    /* Connect to the database */
+    report_start = clock_now();
+    conn = connectDatabase(&cparams, progname, opts->verbose, false, false);
+
+    /* The queries depend on the version of the server */
+    opts->major = PQserverVersion(conn) / 10000;
+    opts->minor = opts->major >= 10 ? PQserverVersion(conn) % 100
+                                    : PQserverVersion(conn) / 100 % 100;
+    initcmd = createPQExpBuffer();
+    if (opts->alldbs)
+      fetch_databases();
+
+    if (opts->output == OUTPUT_JSON)
+    {
+      PQExpBuffer buf = createPQExpBuffer();
+
+      appendPQExpBufferStr(buf, "{\n  \"pgreport\": \"" PGREPORT_VERSION "\",\n  \"database\": ");
+      json_string(buf, PQdb(conn));
+      appendPQExpBuffer(buf, ",\n  \"release\": \"%d.%d\",\n  \"sections\": [", opts->major, opts->minor);
+      fputs(buf->data, stdout);
+      destroyPQExpBuffer(buf);
+    }
+    else
+    {
+      printf("=================================================================================\n");
+      printf("== pgreport on database %s, release %d.%d\n", PQdb(conn), opts->major, opts->minor);
+      printf("=================================================================================\n");
+    }
+  }
+  else
+  {
+    printf("\\echo =================================================================================\n");
+    printf("\\echo == pgreport SQL script for a %s release =========================================\n", opts->script);
+    printf("\\echo =================================================================================\n");
+    printf("SET application_name to 'pgreport';\n");
+  }
+
+  /* Fetch version */
+  add_heading("PostgreSQL Version");
+  fetch_version();
+
+  /* Create schema, and set if as our search_path */
+  execute(CREATE_SCHEMA);
+  execute_per_session(SET_SEARCHPATH);
+  /* Install some extensions if they are not already there */
+  install_extension("pg_buffercache");
+  install_extension("pg_visibility");
+  /*
+   * Read pg_buffercache once, as each read locks every buffer header, and
+   * get the buffer sections from this table
+   */
+  if (!execute_setup(BUFFERCACHE_SETUP_TITLE, CREATE_BUFFERCACHE_TABLE_SQL))
+    exit(EXIT_FAILURE);
+  /*
+   * Read pg_class, and the size of each relation, once, and get the sections
+   * about the relations from this table
+   */
+  if (!execute_setup(RELATIONS_SETUP_TITLE, CREATE_RELATIONS_TABLE_SQL))
+    exit(EXIT_FAILURE);
+  /* Install some functions/views */
+  execute(CREATE_GETVALUE_FUNCTION_SQL);
+  sql[0] = '\0';
+  strcat(sql, CREATE_BLOATTABLE_VIEW_SQL_1);
+  append_bloat_filters(sql, sizeof(sql), "tbl", "tbl.oid");
+  strcat(sql, CREATE_BLOATTABLE_VIEW_SQL_2);
+  execute_per_session(sql);
+  sql[0] = '\0';
+  strcat(sql, CREATE_BLOATINDEX_VIEW_SQL_1);
+  strcat(sql, CREATE_BLOATINDEX_VIEW_SQL_2);
+  append_bloat_filters(sql, sizeof(sql), "ci", "i.indrelid");
+  strcat(sql, CREATE_BLOATINDEX_VIEW_SQL_3);
+  execute_per_session(sql);
+  if (opts->bloat_topk > 0 && backend_minimum_version(9,5))
+  {
+    install_extension("pgstattuple");
+  }
+  if (opts->local)
+  {
+    /* the orphaned files are looked for by pgreport itself */
+    find_orphaned_files(conn);
+  }
+  else if (backend_minimum_version(10,0))
+  {
+    execute_per_session(CREATE_ORPHANEDFILES_VIEW_SQL2);
+  }
+  else
+  {
+    execute_per_session(CREATE_ORPHANEDFILES_VIEW_SQL1);
+  }
+
+  /* Same objects in the other databases */
+  if (opts->alldbs)
+    prepare_databases(&cparams);
+
+  /* Fetch postmaster start time */
+  add_heading("PostgreSQL Start time");
+  fetch_postmaster_starttime();
+
+  /* Fetch reload conf time */
+  add_heading("PostgreSQL Reload conf time");
+  fetch_postmaster_reloadconftime();
+
+  /* Fetch settings by various ways */
+  add_heading("PostgreSQL Configuration");
+  fetch_table(SETTINGS_BY_SOURCEFILE_TITLE, SETTINGS_BY_SOURCEFILE_SQL);
+  fetch_table(SETTINGS_NOTCONFIGFILE_NOTDEFAULTVALUE_TITLE,
+        SETTINGS_NOTCONFIGFILE_NOTDEFAULTVALUE_SQL);
+  if (backend_minimum_version(9,5))
+  {
+    fetch_table(PGFILESETTINGS_TITLE, PGFILESETTINGS_SQL);
+  }
+  if (backend_minimum_version(10,0))
+  {
+    fetch_table(PGHBAFILERULES_TITLE, PGHBAFILERULES_SQL);
+  }
+  if (backend_minimum_version(15,0))
+  {
+    fetch_table(PGIDENTFILEMAPPINGS_TITLE, PGIDENTFILEMAPPINGS_SQL);
+  }
+  fetch_table(PGSETTINGS_TITLE, PGSETTINGS_SQL);
+
+  /* Fetch global objects */
+  add_heading("Global objects");
+  fetch_table(CLUSTER_HITRATIO_TITLE, CLUSTER_HITRATIO_SQL);
+  fetch_table(CLUSTER_BUFFERSUSAGE_TITLE, CLUSTER_BUFFERSUSAGE_SQL);
+  fetch_table(CLUSTER_BUFFERSUSAGEDIRTY_TITLE, CLUSTER_BUFFERSUSAGEDIRTY_SQL);
+  fetch_expensive_table(DATABASES_TITLE, DATABASES_SQL);
+  fetch_table(DATABASES_IN_CACHE_TITLE, DATABASES_IN_CACHE_SQL);
+  fetch_expensive_table(TABLESPACES_TITLE, TABLESPACES_SQL);
+  fetch_table(ROLES_TITLE, backend_minimum_version(9,5) ? ROLES_SQL_95min : ROLES_SQL_94max);
+  fetch_table(USER_PASSWORDS_TITLE, USER_PASSWORDS_SQL);
+  fetch_table(DATABASEUSER_CONFIG_TITLE, DATABASEUSER_CONFIG_SQL);
+
+  /* Fetch local objects of the current database */
+  if (opts->alldbs)
+  {
+    snprintf(heading, sizeof(heading), "Local objects in all databases (%d)", ndatabases);
+    add_heading(heading);
+  }
+  else if (opts->direct)
+  {
+    snprintf(heading, sizeof(heading), "Local objects in database %s", PQdb(conn));
+    add_heading(heading);
+  }
+  else if (backend_minimum_version(9,3))
+  {
+    printf("SELECT current_database() AS db \\gset");
+    printf("\\echo # Local objects in database :'db'\n\n");
+  }
+  else
+  {
+    add_heading("Local objects in current database");
+  }
+  local_part = true;
+  fetch_table(SCHEMAS_TITLE, SCHEMAS_SQL);
+  fetch_table(NBRELS_IN_SCHEMA_TITLE, NBRELS_IN_SCHEMA_SQL);
+  if (backend_minimum_version(11,0))
+  {
+    fetch_table(NBFUNCSPROCS_IN_SCHEMA_TITLE,
+          NBFUNCSPROCS_IN_SCHEMA_SQL);
   }
   else
   {
@@ -407,14 +2630,21 @@ main(int argc, char **argv)
   fetch_table(EXTENSIONSTABLE_TITLE, EXTENSIONSTABLE_SQL);
   fetch_table(KINDS_SIZE_TITLE, KINDS_SIZE_SQL);
   fetch_table(DEPENDENCIES_TITLE, DEPENDENCIES_SQL);
-  fetch_table(KINDS_IN_CACHE_TITLE, KINDS_IN_CACHE_SQL);
+  fetch_cluster_table(KINDS_IN_CACHE_TITLE, KINDS_IN_CACHE_SQL);
   fetch_table(AM_SIZE_TITLE, AM_SIZE_SQL);
   fetch_table(INDEXTYPE_TITLE, INDEXTYPE_SQL);
   fetch_table(INDEXONTEXT_TITLE, INDEXONTEXT_SQL);
   fetch_table(PERCENTUSEDINDEXES_TITLE, PERCENTUSEDINDEXES_SQL);
   fetch_table(UNUSEDINDEXES_TITLE, UNUSEDINDEXES_SQL);
-  fetch_table(REDUNDANTINDEXES_TITLE, REDUNDANTINDEXES_SQL);
-  fetch_table(ORPHANEDFILES_TITLE, ORPHANEDFILES_SQL);
+  fetch_expensive_table(REDUNDANTINDEXES_TITLE, REDUNDANTINDEXES_SQL);
+  if (opts->local)
+  {
+    queue_orphaned_files();
+  }
+  else
+  {
+    fetch_expensive_table(ORPHANEDFILES_TITLE, ORPHANEDFILES_SQL);
+  }
   fetch_table(NBFUNCS_TITLE, NBFUNCS_SQL);
   if (backend_minimum_version(11,0))
   {
@@ -425,33 +2655,61 @@ main(int argc, char **argv)
   {
     fetch_table(FUNCS_PER_SCHEMA_TITLE, FUNCS_PER_SCHEMA_SQL);
   }
-  fetch_table(LOBJ_TITLE, LOBJ_SQL);
+  fetch_expensive_table(LOBJ_TITLE, LOBJ_SQL);
   fetch_table(LOBJ_STATS_TITLE, LOBJ_STATS_SQL);
   fetch_table(RELOPTIONS_TITLE, RELOPTIONS_SQL);
   fetch_table(NEEDVACUUM_TITLE, NEEDVACUUM_SQL);
   fetch_table(NEEDANALYZE_TITLE, NEEDANALYZE_SQL);
-  fetch_table(MINAGE_TITLE, MINAGE_SQL);
+  fetch_cluster_table(MINAGE_TITLE, MINAGE_SQL);
   fetch_table(TOBEFROZEN_TABLES_TITLE, TOBEFROZEN_TABLES_SQL);
-  fetch_table(BLOATOVERVIEW_TITLE, BLOATOVERVIEW_SQL);
-  fetch_table(TOP20BLOAT_TABLES_TITLE, TOP20BLOAT_TABLES_SQL);
-  fetch_table(TOP20BLOAT_INDEXES_TITLE, TOP20BLOAT_INDEXES_SQL);
-  fetch_table(REPSLOTS_TITLE, REPSLOTS_SQL);
+  fetch_expensive_table(BLOATOVERVIEW_TITLE, BLOATOVERVIEW_SQL);
+  fetch_expensive_table(TOP20BLOAT_TABLES_TITLE, TOP20BLOAT_TABLES_SQL);
+  fetch_expensive_table(TOP20BLOAT_INDEXES_TITLE, TOP20BLOAT_INDEXES_SQL);
+  if (opts->bloat_topk > 0 && backend_minimum_version(9,5))
+  {
+    fetch_expensive_table(psprintf(TOPKBLOAT_MEASURED_TITLE, opts->bloat_topk),
+      psprintf(TOPKBLOAT_MEASURED_SQL, opts->bloat_topk));
+  }
+  fetch_cluster_table(REPSLOTS_TITLE, REPSLOTS_SQL);
   if (backend_minimum_version(10,0))
   {
     fetch_table(PUBLICATIONS_TITLE, PUBLICATIONS_SQL);
-    fetch_table(SUBSCRIPTIONS_TITLE, SUBSCRIPTIONS_SQL);
+    fetch_cluster_table(SUBSCRIPTIONS_TITLE, SUBSCRIPTIONS_SQL);
   }
   /*
   fetch_table(TOP10QUERYIDS_TITLE, TOP10QUERYIDS_SQL);
   fetch_table(TOP10QUERIES_TITLE, TOP10QUERIES_SQL);
   */
 
+  /* Execute the report, and show what it cost */
+  if (opts->direct)
+  {
+    run_sections(&cparams);
+    print_summary();
+    if (opts->capture)
+      write_capture(opts->capture);
+  }
+
   /*
    * Uninstall all
    * Actually, it drops our schema, which should get rid of all our stuff
    */
+  if (opts->bloat_topk > 0 && backend_minimum_version(9,5))
+  {
+    /* only if we created it, in our schema, rather than the user */
+    execute(DROP_PGSTATTUPLE);
+  }
   execute(DROP_ALL);
+  if (opts->alldbs)
+    cleanup_databases(&cparams);
 
+  /* cleanup */
+  if (opts->direct)
+  {
+    ParallelSlotsTerminate(slots);
+    destroyPQExpBuffer(initcmd);
+    pg_free(sections);
+  }
   pg_free(opts);
 
   return 0;
@@ -10,6 +10,12 @@
  */
 
 
+/*
+ * System headers
+ */
+#include <time.h>
+#include <unistd.h>
+
 /*
  * PostgreSQL headers
  */
@@ -17,6 +23,7 @@
 #include "common/logging.h"
 #include "fe_utils/connect_utils.h"
 #include "libpq/pqsignal.h"
+#include "pqexpbuffer.h"
 
 /*
  * Defines
@@ -24,17 +31,30 @@
 #define PGWAITEVENT_VERSION "1.4.0"
 #define  PGWAITEVENT_DEFAULT_LINES 20
 #define  PGWAITEVENT_DEFAULT_STRING_SIZE 2048
+#define  PGWAITEVENT_PROFILE_SIZE 64
+#define  PGWAITEVENT_DEFAULT_INFLIGHT 1000
+#define  PGWAITEVENT_STRIP_WIDTH 60
+#define  PGWAITEVENT_BLOCKERS_INTERVAL 0.1
 
 
 /*
  * Structs
  */
 
+/* output formats of the profiles */
+typedef enum
+{
+  OUTPUT_TABLE = 0,
+  OUTPUT_FOLDED,
+  OUTPUT_TIMELINE
+} output_t;
+
 /* these are the options structure for command line parameters */
 struct options
 {
   /* misc */
-  bool  verbose;
+  bool     verbose;
+  output_t output;
 
   /* connection parameters */
   char  *dbname;
@@ -49,24 +69,220 @@ struct options
   /* pid */
   int   pid;
 
+  /* trace all active backends, and how many queries at most */
+  bool  allbackends;
+  int   maxinflight;
+
+  /* report the top queries every report_interval seconds */
+  int   report_interval;
+  int   top;
+
   /* include leader and workers PIDs */
   bool  includeleaderworkers;
 
+  /* sample from a server-side function rather than from the client */
+  bool  serverside;
+
+  /* record the wait events of each process over time */
+  bool  timeline;
+
+  /* find the blockers of the Lock waits */
+  bool  blockers;
+
+  /* read the CPU usage of the backends in /proc, on the server host */
+  bool  local;
+
   /* frequency */
   float interval;
 
   /* query and trace timestamps */
   char  *query_start;
   char  *trace_start;
+
+  /* query traced, and its query_id */
+  char  *query;
+  char  *queryid;
 };
 
+/* number of samples of a wait event */
+typedef struct
+{
+  char *event;
+  char *type;
+  long occurences;
+} waitevent;
+
+/* wait events profile of a query, as a hash table of its wait events */
+typedef struct
+{
+  int       nentries;
+  int       size;
+  long      nsamples;
+  waitevent *entries;
+} profile;
+
+/* wait event of a process from the given time till the next transition */
+typedef struct
+{
+  double     time;     /* seconds since the first sample of the query */
+  const char *event;   /* strings of the profile of the process */
+  const char *type;
+} transition;
+
+/* wait events of a process over time, run-length encoded */
+typedef struct
+{
+  int        ntransitions;
+  int        maxtransitions;
+  transition *transitions;
+  double     end;      /* time of the last sample */
+} timeline;
+
+/* a process blocking the traced one */
+typedef struct
+{
+  int    pid;
+  char   *queryid;
+  char   *state;
+  double samples;   /* Lock samples, shared between the blockers of each */
+} blocker;
+
+/* blockers of the Lock waits of a process */
+typedef struct
+{
+  int     nblockers;
+  int     maxblockers;
+  blocker *blockers;
+  int     ncurrent;         /* blockers found by the last snapshot */
+  int     maxcurrent;
+  int     *current;
+  long    nsamples;         /* Lock samples */
+  double  unknown;          /* Lock samples without any blocker found */
+  double  snapshot;         /* time of the last snapshot */
+  bool    waiting;          /* the last sample was a Lock wait */
+} blockers;
+
+/* CPU usage of a process, as read in /proc, in seconds */
+typedef struct
+{
+  char   state;
+  double utime;
+  double stime;
+  double iowait;            /* only counted with task_delayacct */
+  double oncpu;             /* from schedstat */
+  double runqueue;
+} procstat;
+
+/* CPU usage of a process while it executes a query */
+typedef struct
+{
+  bool     valid;           /* first and last are set */
+  procstat first;
+  procstat last;
+} cpustats;
+
+/* a query being traced in all backends mode */
+typedef struct inflight
+{
+  int             pid;
+  char            *query_start;
+  char            *query;
+  char            *queryid;
+  double          first_elapsed;   /* age of the query at its first sample */
+  double          last_elapsed;    /* age of the query at its last sample */
+  long            lastseen;        /* number of the last sample */
+  long            nticks;          /* number of samples of the query */
+  int             nprocesses;      /* processes in the last sample */
+  int             maxprocesses;    /* processes in the biggest sample */
+  profile         profile;
+  timeline        timeline;        /* of the PID, not of its workers */
+  blockers        blockers;        /* of the PID, not of its workers */
+  cpustats        cpu;             /* of the PID, not of its workers */
+  struct inflight *hnext;          /* next query in the same hash bucket */
+  struct inflight *prev;           /* LRU list, most recently sampled first */
+  struct inflight *next;
+} inflight;
+
+/* timing of the samples */
+typedef struct
+{
+  long   nsamples;
+  long   missed;           /* samples skipped to keep up with the rate */
+  double first;            /* time of the first sample */
+  double last;             /* time of the last sample */
+  double lateness_sum;     /* delay between the planned and actual times */
+  double lateness_max;
+  double latency_sum;      /* duration of the sampling query */
+  double latency_max;
+} samplingstats;
+
+/* wait events profile of one process of a parallel query */
+typedef struct
+{
+  int      pid;
+  profile  profile;
+  timeline timeline;
+} processprofile;
+
+/* number of processes seen on consecutive samples */
+typedef struct
+{
+  int  nprocesses;
+  long nsamples;
+} parallelismrun;
+
+/* profiles of the processes of a parallel query, and its parallelism */
+typedef struct
+{
+  int            nprocesses;
+  int            maxprocesses;
+  processprofile *processes;
+  int            nruns;
+  int            maxruns;
+  parallelismrun *runs;
+} parallelism;
+
+/* wait events profile of all the executions of a query */
+typedef struct
+{
+  char    *queryid;
+  char    *query;
+  long    executions;
+  profile profile;
+} queryprofile;
+
+/* hash table of the query profiles, by query_id */
+typedef struct
+{
+  int          nentries;
+  int          size;
+  queryprofile *entries;
+} queryprofiles;
+
+/* queries being traced, by PID, with a bounded number of them */
+typedef struct
+{
+  int      count;
+  int      max;
+  int      nbuckets;
+  inflight **buckets;
+  inflight *pool;
+  inflight *freelist;
+  inflight *head;
+  inflight *tail;
+} inflights;
+
 
 /*
  * Global variables
  */
-PGconn         *conn;
-struct options *opts;
-extern char    *optarg;
+PGconn                *conn;
+struct options        *opts;
+extern char           *optarg;
+volatile sig_atomic_t stop_requested = false;
+queryprofiles         queries = {0, 0, NULL};
+time_t                next_report;
+samplingstats         runstats;
 
 
 /*
@@ -80,10 +296,74 @@ char        *pg_strdup(const char *in);
 #endif
 void        fetch_version(void);
 bool        backend_minimum_version(int major, int minor);
+void        setup_session(void);
+int         profile_slot(profile *p, const char *event, const char *type);
+void        profile_add(profile *p, const char *event, const char *type, long occurences);
+void        profile_reset(profile *p);
+void        profile_merge(profile *dst, profile *src);
+waitevent   *profile_sorted(profile *p);
+static int  compare_waitevents(const void *a, const void *b);
+void        print_profile_header(void);
+void        print_profile_row(const char *event, const char *type, long occurences, double percent);
+void        print_profile_footer(void);
+void        print_profile(profile *p);
+void        print_folded(const char *queryid, profile *p);
+void        print_durations(void);
+void        timeline_add(timeline *tl, double time, profile *p,
+                         const char *event, const char *type);
+void        timeline_reset(timeline *tl);
+void        print_timeline(int pid, timeline *tl, profile *p);
+void        print_transitions(const char *queryid, int pid, timeline *tl);
+double      clock_now(void);
+void        stats_reset(samplingstats *st);
+void        stats_add(samplingstats *st, double deadline, double begin, double end);
+void        print_stats(samplingstats *st);
+double      wait_next_sample(double deadline, long *missed);
 void        build_env(void);
 bool        active_session(void);
 void        handle_current_query(void);
 void        drop_env(void);
+void        prepare_sampler(void);
+PGresult    *sample_wait_events(void);
+void        parallelism_add_sample(parallelism *pl, PGresult *res, double time,
+                                   const char *leaderevent);
+double      parallelism_average(parallelism *pl, long from, long to);
+void        print_parallelism(parallelism *pl);
+void        parallelism_reset(parallelism *pl);
+void        prepare_blockers_sampler(void);
+PGresult    *sample_blockers(int *pids, int npids);
+bool        blockers_need_snapshot(blockers *b, const char *type, double now);
+void        blockers_set_snapshot(blockers *b, PGresult *res, int pid, int *row,
+                                  double now);
+void        blockers_share_sample(blockers *b);
+void        blockers_add_sample(blockers *b, int pid, const char *type, double now);
+static int  compare_pids(const void *a, const void *b);
+void        sample_all_blockers(inflights *t, int *pids, int npids, double now);
+static int  compare_blockers(const void *a, const void *b);
+void        print_blockers(blockers *b);
+void        blockers_reset(blockers *b);
+bool        read_procstat(int pid, procstat *ps, char *comm, size_t commsize);
+void        check_local(void);
+const char  *local_event(cpustats *cs, int pid, const char *event);
+void        print_cpustats(cpustats *cs);
+void        end_query(profile *p, parallelism *pl, timeline *tl, blockers *bl,
+                      cpustats *cs, samplingstats *st);
+void        trace_session(void);
+void        inflights_init(inflights *t, int max);
+inflight    *inflight_lookup(inflights *t, int pid);
+void        inflight_unlink(inflights *t, inflight *e);
+void        inflight_touch(inflights *t, inflight *e);
+inflight    *inflight_add(inflights *t, int pid, const char *query_start,
+                          const char *query, const char *queryid);
+void        end_inflight(inflights *t, inflight *e, const char *why);
+void        prepare_all_sampler(void);
+void        trace_all_sessions(void);
+int         queryprofiles_slot(queryprofiles *t, const char *queryid);
+void        add_query_profile(const char *queryid, const char *query, profile *p);
+static int  compare_queryprofiles(const void *a, const void *b);
+void        print_top_queries(void);
+void        print_folded_queries(void);
+void        report_top_queries(bool force);
 static void quit_properly(SIGNAL_ARGS);
 
 
@@ -96,9 +376,28 @@ help(const char *progname)
   printf("%s gathers every wait events from a specific PID, grouping them by queries.\n\n"
     "Usage:\n"
     "  %s [OPTIONS] PID\n"
+    "  %s [OPTIONS] -a\n"
     "\nGeneral options:\n"
+    "  -a                     trace all active backends\n"
+    "  -b                     find the blockers of the Lock waits\n"
     "  -g                     include leader and workers (parallel queries) [v13+]\n"
     "  -i                     interval (default is 1s)\n"
+    "  -L                     read the CPU usage of the backends in /proc\n"
+    "                         (pgwaitevent must run on the server host)\n"
+    "  -m NUM                 trace at most NUM queries at once with -a\n"
+    "                         (default is 1000)\n"
+    "  -o FORMAT              output format of the profiles (table, folded or\n"
+    "                         timeline, default is table)\n"
+    "  -n NUM                 number of queries in the top queries report\n"
+    "                         (default is 20)\n"
+    "  -r RATE                sampling rate, in samples per second\n"
+    "                         (same as -i 1/RATE)\n"
+    "  -S                     sample from a server-side PL/pgSQL function\n"
+    "                         (needs to create a temporary table and function,\n"
+    "                         so not on a standby)\n"
+    "  -t SECONDS             aggregate the wait events by query_id, and report\n"
+    "                         the top queries every SECONDS [v14+]\n"
+    "  -T                     show the wait events of each process over time\n"
     "  -v                     verbose\n"
     "  -?|--help              show this help, then exit\n"
     "  -V|--version           output version information, then exit\n"
@@ -108,7 +407,7 @@ help(const char *progname)
     "  -U USER                connect as specified database user\n"
     "  -d DBNAME              database to connect to\n\n"
     "Report bugs to <guillaume@lelarge.info>.\n",
-    progname, progname);
+    progname, progname, progname);
 }
 
 
@@ -125,12 +424,21 @@ get_opts(int argc, char **argv)
 
   /* set the defaults */
   opts->verbose = false;
+  opts->output = OUTPUT_TABLE;
   opts->dbname = NULL;
   opts->hostname = NULL;
   opts->port = NULL;
   opts->username = NULL;
   opts->pid = 0;
+  opts->allbackends = false;
+  opts->maxinflight = PGWAITEVENT_DEFAULT_INFLIGHT;
+  opts->report_interval = 0;
+  opts->top = PGWAITEVENT_DEFAULT_LINES;
   opts->includeleaderworkers = false;
+  opts->serverside = false;
+  opts->timeline = false;
+  opts->blockers = false;
+  opts->local = false;
   opts->interval = 1;
 
   /* we should deal quickly with help and version */
@@ -149,10 +457,20 @@ get_opts(int argc, char **argv)
   }
 
   /* get options */
-  while ((c = getopt(argc, argv, "h:p:U:d:i:gv")) != -1)
+  while ((c = getopt(argc, argv, "h:p:U:d:i:m:n:o:r:t:abgLSTv")) != -1)
   {
     switch (c)
     {
+        /* all backends */
+      case 'a':
+        opts->allbackends = true;
+        break;
+
+        /* blockers */
+      case 'b':
+        opts->blockers = true;
+        break;
+
         /* specify the database */
       case 'd':
         opts->dbname = pg_strdup(optarg);
@@ -171,6 +489,62 @@ get_opts(int argc, char **argv)
         /* interval */
       case 'i':
         opts->interval = atof(optarg);
+        if (opts->interval <= 0)
+        {
+          pg_log_error("Invalid interval.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* local server */
+      case 'L':
+        opts->local = true;
+        break;
+
+        /* maximum number of traced queries */
+      case 'm':
+        opts->maxinflight = atoi(optarg);
+        if (opts->maxinflight <= 0)
+        {
+          pg_log_error("Invalid maximum number of traced queries.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* number of top queries */
+      case 'n':
+        opts->top = atoi(optarg);
+        if (opts->top <= 0)
+        {
+          pg_log_error("Invalid number of top queries.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* output format */
+      case 'o':
+        if (!strcmp(optarg, "table"))
+        {
+          opts->output = OUTPUT_TABLE;
+        }
+        else if (!strcmp(optarg, "folded"))
+        {
+          opts->output = OUTPUT_FOLDED;
+        }
+        else if (!strcmp(optarg, "timeline"))
+        {
+          opts->output = OUTPUT_TIMELINE;
+          opts->timeline = true;
+        }
+        else
+        {
+          pg_log_error("Unknown output format \"%s\".\n", optarg);
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
         break;
 
         /* port to connect to on remote host */
@@ -178,6 +552,38 @@ get_opts(int argc, char **argv)
         opts->port = pg_strdup(optarg);
         break;
 
+        /* server-side sampling */
+      case 'S':
+        opts->serverside = true;
+        break;
+
+        /* sampling rate */
+      case 'r':
+        if (atof(optarg) <= 0)
+        {
+          pg_log_error("Invalid sampling rate.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        opts->interval = 1 / atof(optarg);
+        break;
+
+        /* top queries report interval */
+      case 't':
+        opts->report_interval = atoi(optarg);
+        if (opts->report_interval <= 0)
+        {
+          pg_log_error("Invalid report interval.\n");
+          pg_log_info("Try \"%s --help\" for more information.\n", progname);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+        /* timelines */
+      case 'T':
+        opts->timeline = true;
+        break;
+
         /* username */
       case 'U':
         opts->username = pg_strdup(optarg);
@@ -194,8 +600,50 @@ get_opts(int argc, char **argv)
     }
   }
 
+  /* check incompatible options */
+  if (opts->serverside && opts->allbackends)
+  {
+    pg_log_error("Server-side sampling cannot be used with -a.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (opts->serverside && opts->local)
+  {
+    pg_log_error("Server-side sampling cannot be used with -L.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (opts->serverside && opts->report_interval > 0)
+  {
+    pg_log_error("Server-side sampling cannot be used with -t.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (opts->serverside && (opts->output != OUTPUT_TABLE || opts->timeline))
+  {
+    pg_log_error("Server-side sampling can only print tables, without timelines.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (opts->timeline && (opts->report_interval > 0 || opts->output == OUTPUT_FOLDED))
+  {
+    pg_log_error("Timelines cannot be used with -t or -o folded.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (opts->blockers && (opts->serverside || opts->report_interval > 0 ||
+                         opts->output != OUTPUT_TABLE))
+  {
+    pg_log_error("Blockers can only be printed in tables, without -S or -t.\n");
+    exit(EXIT_FAILURE);
+  }
+
   /* get PID to monitor */
-  if (optind < argc)
+  if (opts->allbackends)
+  {
+    if (optind < argc)
+    {
+      pg_log_error("PID cannot be used with -a.\n");
+      pg_log_info("Try \"%s --help\" for more information.\n", progname);
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (optind < argc)
   {
     opts->pid = atoi(argv[optind]);
   }
@@ -316,30 +764,18 @@ backend_minimum_version(int major, int minor)
 
 
 /*
- * Close the PostgreSQL connection, and quit
- */
-static void
-quit_properly(SIGNAL_ARGS)
-{
-  drop_env();
-  PQfinish(conn);
-  exit(EXIT_FAILURE);
-}
-
-
-/*
- * Create function
+ * Make the session read-only, unless the server-side sampler needs to
+ * create its temporary objects, which can't be done on a standby
  */
 void
-build_env()
+setup_session()
 {
   char     sql[PGWAITEVENT_DEFAULT_STRING_SIZE];
   PGresult *res;
+  bool     standby;
 
-  /* build the DDL query */
-  snprintf(sql, sizeof(sql),
-"CREATE TEMPORARY TABLE waitevents (we text, wet text, o integer);\n"
-"ALTER TABLE waitevents ADD UNIQUE(we, wet);\n");
+  /* build the query */
+  snprintf(sql, sizeof(sql), "SELECT pg_is_in_recovery()");
 
   /* make the call */
   res = PQexec(conn, sql);
@@ -353,16 +789,26 @@ build_env()
     PQfinish(conn);
     exit(EXIT_FAILURE);
   }
+  standby = strcmp(PQgetvalue(res, 0, 0), "t") == 0;
+  PQclear(res);
 
   /* print verbose */
-  if (opts->verbose)
-    printf("Temporary table created\n");
+  if (opts->verbose && standby)
+    printf("Connected to a standby\n");
 
-  /* cleanup */
-  PQclear(res);
+  if (opts->serverside)
+  {
+    if (standby)
+    {
+      pg_log_error("Server-side sampling cannot be used on a standby, drop -S.");
+      PQfinish(conn);
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
 
-  /* build the DDL query */
-  snprintf(sql, sizeof(sql), "CREATE SCHEMA pgwaitevent;");
+  /* the client-side samplers only read pg_stat_activity */
+  snprintf(sql, sizeof(sql), "SET default_transaction_read_only TO on");
 
   /* make the call */
   res = PQexec(conn, sql);
@@ -377,289 +823,1920 @@ build_env()
     exit(EXIT_FAILURE);
   }
 
-  /* print verbose */
-  if (opts->verbose)
-    printf("Schema created\n");
-
-  /* build the DDL query */
-  snprintf(sql, sizeof(sql),
-"CREATE OR REPLACE FUNCTION pgwaitevent.trace_wait_events_for_pid(p integer, leader boolean, s numeric default 1)\n"
-"RETURNS TABLE (wait_event text, wait_event_type text, occurences integer, percent numeric(5,2))\n"
-"LANGUAGE plpgsql\n"
-"AS $$\n"
-"DECLARE\n"
-"  q text;\n"
-"  r record;\n"
-"BEGIN\n"
-"  -- check it is a backend\n"
-"  SELECT query INTO q FROM pg_stat_activity\n"
-"  WHERE pid=p AND backend_type='client backend' AND state='active';\n"
-"\n"
-"  IF NOT FOUND THEN\n"
-"    RAISE EXCEPTION 'PID %% doesn''t appear to be an active backend', p\n"
-"      USING HINT = 'Check the PID and its state';\n"
-"  END IF;\n"
-"\n"
-"  -- logging\n"
-"  RAISE LOG 'Tracing PID %%, sampling at %%s', p, s;\n"
-"  RAISE LOG 'Query is <%%>', q;\n"
-"\n"
-"  -- drop if exists, then create temp table\n"
-"  TRUNCATE waitevents;\n"
-"\n"
-"  -- loop till the end of the query\n"
-"  LOOP\n"
-"    -- get wait event\n"
-"    IF leader THEN\n"
-"      SELECT COALESCE(psa.wait_event, '[Running]') AS wait_event,\n"
-"           COALESCE(psa.wait_event_type, '')   AS wait_event_type\n"
-"      INTO   r\n"
-"      FROM   pg_stat_activity psa\n"
-"      WHERE  pid=p OR leader_pid=p;\n"
-"    ELSE\n"
-"      SELECT COALESCE(psa.wait_event, '[Running]') AS wait_event,\n"
-"           COALESCE(psa.wait_event_type, '')   AS wait_event_type\n"
-"      INTO   r\n"
-"      FROM   pg_stat_activity psa\n"
-"      WHERE  pid=p;\n"
-"    END IF;\n"
-"\n"
-"    -- loop control\n"
-"    EXIT WHEN r.wait_event = 'ClientRead';\n"
-"\n"
-"    -- update wait events stats\n"
-"    INSERT INTO waitevents VALUES (r.wait_event, r.wait_event_type, 1)\n"
-"      ON CONFLICT (we,wet) DO UPDATE SET o = waitevents.o+1;\n"
-"\n"
-"    -- sleep a bit\n"
-"    PERFORM pg_sleep(s);\n"
-"  END LOOP;\n"
-"\n"
-"  -- return stats\n"
-"  RETURN QUERY\n"
-"    SELECT we, wet, o, (o*100./sum(o) over ())::numeric(5,2)\n"
-"    FROM waitevents\n"
-"    ORDER BY o DESC;\n"
-"END\n"
-"$$;\n");
+  /* cleanup */
+  PQclear(res);
+}
 
-  /* make the call */
-  res = PQexec(conn, sql);
 
-  /* check and deal with errors */
-  if (!res || PQresultStatus(res) > 2)
+/*
+ * Close the PostgreSQL connection, and quit
+ */
+static void
+quit_properly(SIGNAL_ARGS)
+{
+  /* the client-side sampler stops by itself before its next sample */
+  if (!opts->serverside)
   {
-    pg_log_error("query failed: %s", PQerrorMessage(conn));
-    pg_log_info("query was: %s", sql);
-    PQclear(res);
-    PQfinish(conn);
-    exit(EXIT_FAILURE);
+    stop_requested = true;
+    return;
   }
 
-  /* print verbose */
-  if (opts->verbose)
-    printf("Function created\n");
-
-  /* cleanup */
-  PQclear(res);
+  drop_env();
+  PQfinish(conn);
+  exit(EXIT_FAILURE);
 }
 
 
 /*
- * Is PID an active session?
+ * Find the slot of a wait event in a profile, or the empty slot where it
+ * should go
  */
-bool
-active_session()
+int
+profile_slot(profile *p, const char *event, const char *type)
 {
-  char     sql[PGWAITEVENT_DEFAULT_STRING_SIZE];
-  PGresult *res;
-  bool     active = false;
+  uint32     hash = 2166136261u;
+  const char *c;
+  int        slot;
+
+  /* FNV-1a hash of the wait event type and name */
+  for (c = type; *c; c++)
+    hash = (hash ^ (unsigned char) *c) * 16777619u;
+  hash = (hash ^ ':') * 16777619u;
+  for (c = event; *c; c++)
+    hash = (hash ^ (unsigned char) *c) * 16777619u;
+
+  /* linear probing, the size being a power of two */
+  slot = hash & (p->size - 1);
+  while (p->entries[slot].event != NULL &&
+         (strcmp(p->entries[slot].event, event) != 0 ||
+          strcmp(p->entries[slot].type, type) != 0))
+    slot = (slot + 1) & (p->size - 1);
+
+  return slot;
+}
 
-  /* build the query */
-  snprintf(sql, sizeof(sql),
-    "SELECT state, query, query_start, now() FROM pg_stat_activity\n"
-    "WHERE backend_type='client backend'\n"
-    "AND pid=%d",
-    opts->pid);
 
-  /* make the call */
-  res = PQexec(conn, sql);
+/*
+ * Add occurences of a wait event to a profile
+ */
+void
+profile_add(profile *p, const char *event, const char *type, long occurences)
+{
+  int slot;
+  int i;
 
-  /* check and deal with errors */
-  if (!res || PQresultStatus(res) > 2)
+  /* grow the hash table when it is half full */
+  if (p->nentries * 2 >= p->size)
   {
-    pg_log_error("query failed: %s", PQerrorMessage(conn));
-    pg_log_info("query was: %s", sql);
-    PQclear(res);
-    PQfinish(conn);
-    exit(EXIT_FAILURE);
+    waitevent *old = p->entries;
+    int       oldsize = p->size;
+
+    p->size = oldsize > 0 ? oldsize * 2 : PGWAITEVENT_PROFILE_SIZE;
+    p->entries = (waitevent *) pg_malloc0(p->size * sizeof(waitevent));
+    for (i = 0; i < oldsize; i++)
+    {
+      if (old[i].event != NULL)
+        p->entries[profile_slot(p, old[i].event, old[i].type)] = old[i];
+    }
+    pg_free(old);
   }
 
-  /* if zero row, then PID is gone */
-  if (PQntuples(res) == 0)
+  slot = profile_slot(p, event, type);
+  if (p->entries[slot].event == NULL)
   {
-    printf("\nNo more session with PID %d, exiting...\n", opts->pid);
-    drop_env();
-    PQfinish(conn);
-    exit(2);
+    p->entries[slot].event = pg_strdup(event);
+    p->entries[slot].type = pg_strdup(type);
+    p->entries[slot].occurences = 0;
+    p->nentries++;
   }
+  p->entries[slot].occurences += occurences;
+  p->nsamples += occurences;
+}
 
-  /* if one row, we found the good one */
-  if (PQntuples(res) == 1)
+
+/*
+ * Forget every wait event of a profile
+ */
+void
+profile_reset(profile *p)
+{
+  int i;
+
+  for (i = 0; i < p->size; i++)
   {
-    if (!strncmp(PQgetvalue(res, 0, 0), "active", 6))
+    if (p->entries[i].event != NULL)
     {
-      active = true;
-      printf("\nNew query: %s\n", PQgetvalue(res, 0, 1));
-      opts->query_start = pg_strdup(PQgetvalue(res, 0, 2));
-      opts->trace_start = pg_strdup(PQgetvalue(res, 0, 3));
+      pg_free(p->entries[i].event);
+      pg_free(p->entries[i].type);
     }
   }
+  pg_free(p->entries);
 
-  /* this also means that in case of multiple rows, we treat it as no rows */
-
-  /* cleanup */
-  PQclear(res);
-
-  return active;
+  p->nentries = 0;
+  p->size = 0;
+  p->nsamples = 0;
+  p->entries = NULL;
 }
 
 
 /*
- * Handle query
+ * Add all the wait events of a profile to another one
  */
 void
-handle_current_query()
+profile_merge(profile *dst, profile *src)
 {
-  char     sql[PGWAITEVENT_DEFAULT_STRING_SIZE];
-  PGresult *workers_res;
-  PGresult *trace_res;
-  PGresult *duration_res;
-  int      nrows;
-  int      row;
-  int      nworkers = 0;
+  int i;
 
-  if (opts->includeleaderworkers)
+  for (i = 0; i < src->size; i++)
   {
-    /* build the workers query if the user asked to include leader and workers */
-    snprintf(sql, sizeof(sql), "SELECT count(*) FROM pg_stat_activity "
-                               "WHERE pid=%d OR leader_pid=%d",
-                               opts->pid, opts->pid);
+    if (src->entries[i].event != NULL)
+      profile_add(dst, src->entries[i].event, src->entries[i].type,
+        src->entries[i].occurences);
+  }
+}
+
+
+/*
+ * Get the wait events of a profile, the most frequent first
+ * (the caller frees the array, but not its strings)
+ */
+waitevent *
+profile_sorted(profile *p)
+{
+  waitevent *sorted;
+  int       nsorted = 0;
+  int       i;
+
+  sorted = (waitevent *) pg_malloc((p->nentries + 1) * sizeof(waitevent));
+  for (i = 0; i < p->size; i++)
+  {
+    if (p->entries[i].event != NULL)
+      sorted[nsorted++] = p->entries[i];
+  }
+  qsort(sorted, nsorted, sizeof(waitevent), compare_waitevents);
+
+  return sorted;
+}
+
+
+/*
+ * Order wait events by decreasing occurences, then by name
+ */
+static int
+compare_waitevents(const void *a, const void *b)
+{
+  const waitevent *wa = (const waitevent *) a;
+  const waitevent *wb = (const waitevent *) b;
+
+  if (wa->occurences != wb->occurences)
+    return wa->occurences > wb->occurences ? -1 : 1;
+  return strcmp(wa->event, wb->event);
+}
+
+
+/*
+ * Print the wait events table
+ */
+void
+print_profile_header()
+{
+  (void)printf(
+"┌───────────────────────────────────┬───────────┬────────────┬─────────┐\n"
+"│ Wait event                        │ WE type   │ Occurences │ Percent │\n"
+"├───────────────────────────────────┼───────────┼────────────┼─────────┤\n");
+}
+
+void
+print_profile_row(const char *event, const char *type, long occurences, double percent)
+{
+  (void)printf("│ %-33s │ %-9s │ %10ld │  %6.2f │\n",
+    event, type, occurences, percent);
+}
+
+void
+print_profile_footer()
+{
+  (void)printf(
+"└───────────────────────────────────┴───────────┴────────────┴─────────┘\n");
+}
+
+void
+print_profile(profile *p)
+{
+  waitevent *sorted;
+  int       i;
+
+  sorted = profile_sorted(p);
+
+  print_profile_header();
+  for (i = 0; i < p->nentries; i++)
+  {
+    print_profile_row(sorted[i].event, sorted[i].type, sorted[i].occurences,
+      sorted[i].occurences * 100. / p->nsamples);
+  }
+  print_profile_footer();
+
+  pg_free(sorted);
+}
+
+
+/*
+ * Print a profile as folded stacks, one "query_id;type;event count" line per
+ * wait event, as expected by flame graph tools
+ */
+void
+print_folded(const char *queryid, profile *p)
+{
+  waitevent *sorted;
+  int       i;
+
+  sorted = profile_sorted(p);
+
+  for (i = 0; i < p->nentries; i++)
+  {
+    (void)printf("%s;%s%s%s %ld\n",
+      *queryid ? queryid : "unknown",
+      sorted[i].type,
+      *sorted[i].type ? ";" : "",
+      sorted[i].event,
+      sorted[i].occurences);
+  }
+  fflush(stdout);
+
+  pg_free(sorted);
+}
+
+
+/*
+ * Print the durations of the current query and of its trace
+ */
+void
+print_durations()
+{
+  char     sql[PGWAITEVENT_DEFAULT_STRING_SIZE];
+  PGresult *duration_res;
+
+  /* build the duration query */
+  snprintf(sql, sizeof(sql), "SELECT now()-'%s'::timestamptz, now()-'%s'::timestamptz;",
+    opts->query_start, opts->trace_start);
+
+  /* execute it */
+  duration_res = PQexec(conn, sql);
+
+  /* check and deal with errors */
+  if (!duration_res || PQresultStatus(duration_res) > 2)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", sql);
+    PQclear(duration_res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* show durations */
+  (void)printf("Query duration: %s\n", PQgetvalue(duration_res, 0, 0));
+  (void)printf("Trace duration: %s\n", PQgetvalue(duration_res, 0, 1));
+
+  /* cleanup */
+  PQclear(duration_res);
+}
+
+
+/*
+ * Record the wait event of a process on a sample, the process being in it
+ * till the next transition
+ *
+ * Only the transitions are kept, so the memory used grows with the number
+ * of wait event changes, not with the number of samples. The strings are
+ * the ones of the profile of the process, which must already count the wait
+ * event, and must not be reset before the timeline.
+ */
+void
+timeline_add(timeline *tl, double time, profile *p, const char *event, const char *type)
+{
+  waitevent *w = &p->entries[profile_slot(p, event, type)];
+
+  tl->end = time;
+  if (tl->ntransitions > 0 && tl->transitions[tl->ntransitions - 1].event == w->event)
+    return;
+
+  if (tl->ntransitions == tl->maxtransitions)
+  {
+    tl->maxtransitions = tl->maxtransitions > 0 ? tl->maxtransitions * 2 : 64;
+    tl->transitions = (transition *) pg_realloc(tl->transitions,
+      tl->maxtransitions * sizeof(transition));
+  }
+  tl->transitions[tl->ntransitions].time = time;
+  tl->transitions[tl->ntransitions].event = w->event;
+  tl->transitions[tl->ntransitions].type = w->type;
+  tl->ntransitions++;
+}
+
+
+/*
+ * Forget the transitions of a timeline
+ */
+void
+timeline_reset(timeline *tl)
+{
+  pg_free(tl->transitions);
+  memset(tl, 0, sizeof(timeline));
+}
+
+
+/*
+ * Print a timeline as a strip of letters, each one being the wait event the
+ * process spent the most time in on its part of the trace, and its legend
+ *
+ * The letters follow the order of the profile: A is the most frequent wait
+ * event, B the next one, and so on.
+ */
+void
+print_timeline(int pid, timeline *tl, profile *p)
+{
+  char      strip[PGWAITEVENT_STRIP_WIDTH + 1];
+  double    weights[27];
+  bool      used[27];
+  waitevent *sorted;
+  double    start;
+  double    duration;
+  int       width;
+  int       i;
+  int       j;
+  int       k;
+
+  if (tl->ntransitions == 0)
+    return;
+
+  /* the last sample lasts one interval */
+  start = tl->transitions[0].time;
+  duration = tl->end + opts->interval - start;
+  width = Max(1, Min(PGWAITEVENT_STRIP_WIDTH, (int) (duration / opts->interval + 0.5)));
+
+  sorted = profile_sorted(p);
+  memset(used, 0, sizeof(used));
+  j = 0;
+  for (i = 0; i < width; i++)
+  {
+    double from = start + duration * i / width;
+    double to = start + duration * (i + 1) / width;
+    int    best = 0;
+
+    /* time spent in each wait event on this part of the trace */
+    memset(weights, 0, sizeof(weights));
+    while (j > 0 && (j == tl->ntransitions || tl->transitions[j].time > from))
+      j--;
+    for (; j < tl->ntransitions && tl->transitions[j].time < to; j++)
+    {
+      double tend = j + 1 < tl->ntransitions ? tl->transitions[j + 1].time
+                                             : tl->end + opts->interval;
+
+      /* its letter, or the last one for the less frequent wait events */
+      for (k = 0; k < 26 && k < p->nentries && sorted[k].event != tl->transitions[j].event; k++)
+        ;
+      if (k == p->nentries)
+        k = 26;
+      weights[k] += Min(tend, to) - Max(tl->transitions[j].time, from);
+      if (weights[k] > weights[best])
+        best = k;
+    }
+
+    strip[i] = best < 26 ? 'A' + best : '?';
+    used[best] = true;
+  }
+  strip[width] = '\0';
+
+  (void)printf("Timeline of PID %d (%d transitions, %.3fs per character):\n",
+    pid, tl->ntransitions, duration / width);
+  (void)printf("%s\n", strip);
+  for (k = 0; k < 27; k++)
+  {
+    if (used[k] && k < 26)
+      (void)printf("  %c: %s%s%s\n", 'A' + k,
+        sorted[k].type, *sorted[k].type ? ":" : "", sorted[k].event);
+    else if (used[k])
+      (void)printf("  ?: other wait events\n");
+  }
+
+  pg_free(sorted);
+}
+
+
+/*
+ * Print the transitions of a timeline, one
+ * "query_id;pid;start;end;type;event" line per transition, the times being
+ * in seconds since the first sample of the query
+ */
+void
+print_transitions(const char *queryid, int pid, timeline *tl)
+{
+  int i;
+
+  for (i = 0; i < tl->ntransitions; i++)
+  {
+    (void)printf("%s;%d;%.6f;%.6f;%s;%s\n",
+      *queryid ? queryid : "unknown",
+      pid,
+      tl->transitions[i].time,
+      i + 1 < tl->ntransitions ? tl->transitions[i + 1].time : tl->end + opts->interval,
+      tl->transitions[i].type,
+      tl->transitions[i].event);
+  }
+  fflush(stdout);
+}
+
+
+/*
+ * Current time of a monotonic clock, in seconds
+ */
+double
+clock_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Forget the timing of the samples
+ */
+void
+stats_reset(samplingstats *st)
+{
+  memset(st, 0, sizeof(samplingstats));
+}
+
+
+/*
+ * Record the timing of a sample: when it was planned, when the sampling
+ * query began, and when it ended
+ */
+void
+stats_add(samplingstats *st, double deadline, double begin, double end)
+{
+  if (st->nsamples == 0)
+    st->first = begin;
+  st->last = begin;
+  st->nsamples++;
+  st->lateness_sum += begin - deadline;
+  st->lateness_max = Max(st->lateness_max, begin - deadline);
+  st->latency_sum += end - begin;
+  st->latency_max = Max(st->latency_max, end - begin);
+}
+
+
+/*
+ * Print the achieved sampling rate, and how far the samples were from their
+ * planned time
+ */
+void
+print_stats(samplingstats *st)
+{
+  if (st->nsamples == 0)
+    return;
+
+  (void)printf("Samples: %ld, at %.1f per second (target is %.1f)",
+    st->nsamples,
+    st->nsamples > 1 ? (st->nsamples - 1) / (st->last - st->first) : 0,
+    1 / opts->interval);
+  if (st->missed > 0)
+    (void)printf(", %ld missed", st->missed);
+  (void)printf("\n");
+  (void)printf("Sampling jitter: %.3fms on average, %.3fms at most\n",
+    st->lateness_sum * 1000 / st->nsamples, st->lateness_max * 1000);
+  (void)printf("Sampling latency: %.3fms on average, %.3fms at most\n",
+    st->latency_sum * 1000 / st->nsamples, st->latency_max * 1000);
+}
+
+
+/*
+ * Sleep till the planned time of the next sample, and return it
+ *
+ * Samples are planned on absolute times, every interval since the first one,
+ * so that the time spent to sample doesn't shift the next ones. If the
+ * sampling is too slow for the rate, the samples that could not be taken
+ * are skipped (and counted as missed) rather than taken in a burst.
+ */
+double
+wait_next_sample(double deadline, long *missed)
+{
+  double now = clock_now();
+
+  *missed = 0;
+  deadline += opts->interval;
+  if (now - deadline >= opts->interval)
+  {
+    *missed = (long) ((now - deadline) / opts->interval);
+    deadline += *missed * opts->interval;
+  }
+
+  if (deadline > now)
+    pg_usleep((long) ((deadline - now) * 1000000));
+
+  return deadline;
+}
+
+
+/*
+ * Create function
+ */
+void
+build_env()
+{
+  char     sql[PGWAITEVENT_DEFAULT_STRING_SIZE];
+  PGresult *res;
+
+  /* build the DDL query */
+  snprintf(sql, sizeof(sql),
+"CREATE TEMPORARY TABLE waitevents (we text, wet text, o integer);\n"
+"ALTER TABLE waitevents ADD UNIQUE(we, wet);\n");
+
+  /* make the call */
+  res = PQexec(conn, sql);
+
+  /* check and deal with errors */
+  if (!res || PQresultStatus(res) > 2)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", sql);
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* print verbose */
+  if (opts->verbose)
+    printf("Temporary table created\n");
+
+  /* cleanup */
+  PQclear(res);
+
+  /*
+   * build the DDL query, the function being temporary too, so that nothing
+   * is left behind if we don't get to drop it
+   */
+  snprintf(sql, sizeof(sql),
+"CREATE OR REPLACE FUNCTION pg_temp.trace_wait_events_for_pid(p integer, leader boolean, s numeric default 1)\n"
+"RETURNS TABLE (wait_event text, wait_event_type text, occurences integer, percent numeric(5,2))\n"
+"LANGUAGE plpgsql\n"
+"AS $$\n"
+"DECLARE\n"
+"  q text;\n"
+"  w text;\n"
+"  r record;\n"
+"BEGIN\n"
+"  -- check it is a backend\n"
+"  SELECT query INTO q FROM pg_stat_activity\n"
+"  WHERE pid=p AND backend_type='client backend' AND state='active';\n"
+"\n"
+"  IF NOT FOUND THEN\n"
+"    RAISE EXCEPTION 'PID %% doesn''t appear to be an active backend', p\n"
+"      USING HINT = 'Check the PID and its state';\n"
+"  END IF;\n"
+"\n"
+"  -- logging\n"
+"  RAISE LOG 'Tracing PID %%, sampling at %%s', p, s;\n"
+"  RAISE LOG 'Query is <%%>', q;\n"
+"\n"
+"  -- drop if exists, then create temp table\n"
+"  TRUNCATE waitevents;\n"
+"\n"
+"  -- loop till the end of the query\n"
+"  LOOP\n"
+"    -- loop control, on the wait event of the PID\n"
+"    SELECT COALESCE(psa.wait_event, '[Running]') INTO w\n"
+"    FROM   pg_stat_activity psa\n"
+"    WHERE  pid=p;\n"
+"    EXIT WHEN NOT FOUND OR w = 'ClientRead';\n"
+"\n"
+"    -- update wait events stats, one sample per process\n"
+"    -- (leader_pid only exists in v13+, so it is only named in its branch)\n"
+"    IF leader THEN\n"
+"      FOR r IN\n"
+"        SELECT COALESCE(psa.wait_event, '[Running]') AS wait_event,\n"
+"             COALESCE(psa.wait_event_type, '')   AS wait_event_type\n"
+"        FROM   pg_stat_activity psa\n"
+"        WHERE  pid=p OR leader_pid=p\n"
+"      LOOP\n"
+"        INSERT INTO waitevents VALUES (r.wait_event, r.wait_event_type, 1)\n"
+"          ON CONFLICT (we,wet) DO UPDATE SET o = waitevents.o+1;\n"
+"      END LOOP;\n"
+"    ELSE\n"
+"      FOR r IN\n"
+"        SELECT COALESCE(psa.wait_event, '[Running]') AS wait_event,\n"
+"             COALESCE(psa.wait_event_type, '')   AS wait_event_type\n"
+"        FROM   pg_stat_activity psa\n"
+"        WHERE  pid=p\n"
+"      LOOP\n"
+"        INSERT INTO waitevents VALUES (r.wait_event, r.wait_event_type, 1)\n"
+"          ON CONFLICT (we,wet) DO UPDATE SET o = waitevents.o+1;\n"
+"      END LOOP;\n"
+"    END IF;\n"
+"\n"
+"    -- sleep a bit\n"
+"    PERFORM pg_sleep(s);\n"
+"  END LOOP;\n"
+"\n"
+"  -- return stats\n"
+"  RETURN QUERY\n"
+"    SELECT we, wet, o, (o*100./sum(o) over ())::numeric(5,2)\n"
+"    FROM waitevents\n"
+"    ORDER BY o DESC;\n"
+"END\n"
+"$$;\n");
+
+  /* make the call */
+  res = PQexec(conn, sql);
+
+  /* check and deal with errors */
+  if (!res || PQresultStatus(res) > 2)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", sql);
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* print verbose */
+  if (opts->verbose)
+    printf("Function created\n");
+
+  /* cleanup */
+  PQclear(res);
+}
+
+
+/*
+ * Is PID an active session?
+ */
+bool
+active_session()
+{
+  char     sql[PGWAITEVENT_DEFAULT_STRING_SIZE];
+  PGresult *res;
+  bool     active = false;
+
+  /* build the query */
+  snprintf(sql, sizeof(sql),
+    "SELECT state, query, query_start, now() FROM pg_stat_activity\n"
+    "WHERE backend_type='client backend'\n"
+    "AND pid=%d",
+    opts->pid);
+
+  /* make the call */
+  res = PQexec(conn, sql);
+
+  /* check and deal with errors */
+  if (!res || PQresultStatus(res) > 2)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", sql);
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* if zero row, then PID is gone */
+  if (PQntuples(res) == 0)
+  {
+    printf("\nNo more session with PID %d, exiting...\n", opts->pid);
+    drop_env();
+    PQfinish(conn);
+    exit(2);
+  }
+
+  /* if one row, we found the good one */
+  if (PQntuples(res) == 1)
+  {
+    if (!strncmp(PQgetvalue(res, 0, 0), "active", 6))
+    {
+      active = true;
+      printf("\nNew query: %s\n", PQgetvalue(res, 0, 1));
+      opts->query_start = pg_strdup(PQgetvalue(res, 0, 2));
+      opts->trace_start = pg_strdup(PQgetvalue(res, 0, 3));
+    }
+  }
+
+  /* this also means that in case of multiple rows, we treat it as no rows */
+
+  /* cleanup */
+  PQclear(res);
+
+  return active;
+}
+
+
+/*
+ * Handle query
+ */
+void
+handle_current_query()
+{
+  char     sql[PGWAITEVENT_DEFAULT_STRING_SIZE];
+  PGresult *workers_res;
+  PGresult *trace_res;
+  int      nrows;
+  int      row;
+  int      nworkers = 0;
+
+  if (opts->includeleaderworkers)
+  {
+    /* build the workers query if the user asked to include leader and workers */
+    snprintf(sql, sizeof(sql), "SELECT count(*) FROM pg_stat_activity "
+                               "WHERE pid=%d OR leader_pid=%d",
+                               opts->pid, opts->pid);
 
     /* execute it */
     workers_res = PQexec(conn, sql);
 
-    /* check and deal with errors */
-    if (!workers_res || PQresultStatus(workers_res) > 2)
+    /* check and deal with errors */
+    if (!workers_res || PQresultStatus(workers_res) > 2)
+    {
+      pg_log_error("query failed: %s", PQerrorMessage(conn));
+      pg_log_info("query was: %s", sql);
+      PQclear(workers_res);
+      PQfinish(conn);
+      exit(EXIT_FAILURE);
+    }
+
+    /* get the number of leader and workers */
+    nworkers = atoi(PQgetvalue(workers_res, 0, 0));
+
+    /* clean up */
+    PQclear(workers_res);
+  }
+
+  /* build the trace query */
+  snprintf(sql, sizeof(sql), "SELECT * FROM pg_temp.trace_wait_events_for_pid(%d, %s, %f);",
+    opts->pid, opts->includeleaderworkers ? "'t'" : "'f'", opts->interval);
+
+  /* execute it */
+  trace_res = PQexec(conn, sql);
+
+  /* check and deal with errors */
+  if (!trace_res || PQresultStatus(trace_res) > 2)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", sql);
+    PQclear(trace_res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* show durations */
+  print_durations();
+
+  /* show number of workers */
+  if (opts->includeleaderworkers)
+  {
+    (void)printf("Number of processes: %d\n", nworkers);
+  }
+
+  /* get the number of rows */
+  nrows = PQntuples(trace_res);
+
+  /* print headers */
+  print_profile_header();
+
+  /* for each row, print all columns in a row */
+  for (row = 0; row < nrows; row++)
+  {
+    print_profile_row(
+      PQgetvalue(trace_res, row, 0),
+      PQgetvalue(trace_res, row, 1),
+      atol(PQgetvalue(trace_res, row, 2)),
+      atof(PQgetvalue(trace_res, row, 3))
+    );
+  }
+
+  /* print footers */
+  print_profile_footer();
+
+  /* cleanup */
+  PQclear(trace_res);
+}
+
+
+/*
+ * Drop env
+ */
+void
+drop_env()
+{
+  char     sql[PGWAITEVENT_DEFAULT_STRING_SIZE];
+  PGresult *res;
+
+  /* no need to drop the temp table */
+
+  /* drop function */
+  snprintf(sql, sizeof(sql),
+    "DROP FUNCTION IF EXISTS pg_temp.trace_wait_events_for_pid(integer, boolean, numeric)");
+
+  /* make the call */
+  res = PQexec(conn, sql);
+
+  /* check and deal with errors */
+  if (!res || PQresultStatus(res) > 2)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", sql);
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* print verbose */
+  if (opts->verbose)
+    printf("Function dropped\n");
+
+  /* cleanup */
+  PQclear(res);
+}
+
+
+/*
+ * Prepare the statement used to sample the wait events of the PID (and of
+ * its workers)
+ */
+void
+prepare_sampler()
+{
+  char     sql[PGWAITEVENT_DEFAULT_STRING_SIZE];
+  PGresult *res;
+
+  /* build the sampling query */
+  snprintf(sql, sizeof(sql),
+    "SELECT pid, state, query_start, now(), query,\n"
+    "  COALESCE(wait_event, '[Running]'), COALESCE(wait_event_type, ''),\n"
+    "  %s\n"
+    "FROM pg_stat_activity\n"
+    "WHERE (pid=$1 AND backend_type='client backend')%s\n"
+    "ORDER BY pid<>$1",
+    backend_minimum_version(14, 0) ? "COALESCE(query_id::text, '')" : "''",
+    opts->includeleaderworkers ? " OR leader_pid=$1" : "");
+
+  /* prepare it */
+  res = PQprepare(conn, "sample_wait_events", sql, 1, NULL);
+
+  /* check and deal with errors */
+  if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", sql);
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* cleanup */
+  PQclear(res);
+}
+
+
+/*
+ * Get one sample of the wait events of the PID (and of its workers)
+ */
+PGresult *
+sample_wait_events()
+{
+  char       pid[32];
+  const char *values[1];
+  PGresult   *res;
+
+  snprintf(pid, sizeof(pid), "%d", opts->pid);
+  values[0] = pid;
+
+  /* execute the prepared statement */
+  res = PQexecPrepared(conn, "sample_wait_events", 1, values, NULL, NULL, 0);
+
+  /* check and deal with errors */
+  if (!res || PQresultStatus(res) > 2)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  return res;
+}
+
+
+/*
+ * Record the processes of a parallel query seen on a sample: their wait
+ * events, and how many they are
+ */
+void
+parallelism_add_sample(parallelism *pl, PGresult *res, double time,
+                       const char *leaderevent)
+{
+  int row;
+  int i;
+
+  for (row = 0; row < PQntuples(res); row++)
+  {
+    int        pid = atoi(PQgetvalue(res, row, 0));
+    const char *event = pid == opts->pid ? leaderevent : PQgetvalue(res, row, 5);
+
+    /* find the process, there are only a few of them */
+    for (i = 0; i < pl->nprocesses && pl->processes[i].pid != pid; i++)
+      ;
+    if (i == pl->nprocesses)
+    {
+      if (pl->nprocesses == pl->maxprocesses)
+      {
+        pl->maxprocesses = pl->maxprocesses > 0 ? pl->maxprocesses * 2 : 8;
+        pl->processes = (processprofile *) pg_realloc(pl->processes,
+          pl->maxprocesses * sizeof(processprofile));
+      }
+      memset(&pl->processes[i], 0, sizeof(processprofile));
+      pl->processes[i].pid = pid;
+      pl->nprocesses++;
+    }
+    profile_add(&pl->processes[i].profile, event, PQgetvalue(res, row, 6), 1);
+    if (opts->timeline)
+      timeline_add(&pl->processes[i].timeline, time, &pl->processes[i].profile,
+        event, PQgetvalue(res, row, 6));
+  }
+
+  /* run-length encoding of the number of processes */
+  if (pl->nruns > 0 && pl->runs[pl->nruns - 1].nprocesses == PQntuples(res))
+  {
+    pl->runs[pl->nruns - 1].nsamples++;
+    return;
+  }
+  if (pl->nruns == pl->maxruns)
+  {
+    pl->maxruns = pl->maxruns > 0 ? pl->maxruns * 2 : 64;
+    pl->runs = (parallelismrun *) pg_realloc(pl->runs,
+      pl->maxruns * sizeof(parallelismrun));
+  }
+  pl->runs[pl->nruns].nprocesses = PQntuples(res);
+  pl->runs[pl->nruns].nsamples = 1;
+  pl->nruns++;
+}
+
+
+/*
+ * Average number of processes between two samples (the first one included,
+ * the last one excluded)
+ */
+double
+parallelism_average(parallelism *pl, long from, long to)
+{
+  long   start = 0;
+  long   sum = 0;
+  int    i;
+
+  for (i = 0; i < pl->nruns && start < to; i++)
+  {
+    long end = start + pl->runs[i].nsamples;
+
+    if (end > from)
+      sum += (Min(end, to) - Max(start, from)) * pl->runs[i].nprocesses;
+    start = end;
+  }
+
+  return to > from ? (double) sum / (to - from) : 0;
+}
+
+
+/*
+ * Print the parallelism achieved by a query, and the profile of each of its
+ * processes
+ */
+void
+print_parallelism(parallelism *pl)
+{
+  char   strip[PGWAITEVENT_STRIP_WIDTH + 1];
+  long   nsamples = 0;
+  int    maxprocesses = 0;
+  int    width;
+  int    i;
+
+  for (i = 0; i < pl->nruns; i++)
+  {
+    nsamples += pl->runs[i].nsamples;
+    maxprocesses = Max(maxprocesses, pl->runs[i].nprocesses);
+  }
+  if (nsamples == 0)
+    return;
+
+  /* average number of processes on each part of the trace */
+  width = Min(nsamples, PGWAITEVENT_STRIP_WIDTH);
+  for (i = 0; i < width; i++)
+  {
+    double average = parallelism_average(pl,
+      nsamples * i / width, nsamples * (i + 1) / width);
+
+    strip[i] = average < 9.5 ? '0' + (int) (average + 0.5) : '+';
+  }
+  strip[width] = '\0';
+
+  (void)printf("Number of processes: %d\n", pl->nprocesses);
+  (void)printf("Parallelism: %.2f processes on average, %d at most\n",
+    parallelism_average(pl, 0, nsamples), maxprocesses);
+  (void)printf("Parallelism over time: %s\n", strip);
+
+  /* the leader comes first */
+  for (i = 0; i < pl->nprocesses; i++)
+  {
+    (void)printf("%s PID %d:\n",
+      pl->processes[i].pid == opts->pid ? "Leader" : "Worker",
+      pl->processes[i].pid);
+    print_profile(&pl->processes[i].profile);
+    if (opts->timeline)
+      print_timeline(pl->processes[i].pid, &pl->processes[i].timeline,
+        &pl->processes[i].profile);
+  }
+  (void)printf("All processes:\n");
+}
+
+
+/*
+ * Forget the processes of a parallel query
+ */
+void
+parallelism_reset(parallelism *pl)
+{
+  int i;
+
+  for (i = 0; i < pl->nprocesses; i++)
+  {
+    timeline_reset(&pl->processes[i].timeline);
+    profile_reset(&pl->processes[i].profile);
+  }
+  pg_free(pl->processes);
+  pg_free(pl->runs);
+  memset(pl, 0, sizeof(parallelism));
+}
+
+
+/*
+ * Prepare the statement used to find the processes blocking a set of PIDs,
+ * with their query_id and state
+ */
+void
+prepare_blockers_sampler()
+{
+  char     sql[PGWAITEVENT_DEFAULT_STRING_SIZE];
+  PGresult *res;
+
+  /*
+   * build the query, a prepared transaction being a zero PID, the blockers
+   * of each PID coming together
+   */
+  snprintf(sql, sizeof(sql),
+    "SELECT DISTINCT w.pid, b.pid,\n"
+    "  COALESCE(a.state, CASE WHEN b.pid=0 THEN 'prepared transaction' ELSE '' END),\n"
+    "  %s\n"
+    "FROM unnest($1::integer[]) AS w(pid)\n"
+    "CROSS JOIN LATERAL unnest(pg_blocking_pids(w.pid)) AS b(pid)\n"
+    "LEFT JOIN pg_stat_activity a ON a.pid=b.pid\n"
+    "ORDER BY 1",
+    backend_minimum_version(14, 0) ? "COALESCE(a.query_id::text, '')" : "''");
+
+  /* prepare it */
+  res = PQprepare(conn, "sample_blockers", sql, 1, NULL);
+
+  /* check and deal with errors */
+  if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    pg_log_info("query was: %s", sql);
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* cleanup */
+  PQclear(res);
+}
+
+
+/*
+ * Find the processes blocking a set of PIDs, sorted on these PIDs, with a
+ * single query
+ */
+PGresult *
+sample_blockers(int *pids, int npids)
+{
+  PQExpBuffer array = createPQExpBuffer();
+  const char  *values[1];
+  PGresult    *res;
+  int         i;
+
+  appendPQExpBufferChar(array, '{');
+  for (i = 0; i < npids; i++)
+    appendPQExpBuffer(array, "%s%d", i > 0 ? "," : "", pids[i]);
+  appendPQExpBufferChar(array, '}');
+  values[0] = array->data;
+
+  /* execute the prepared statement */
+  res = PQexecPrepared(conn, "sample_blockers", 1, values, NULL, NULL, 0);
+
+  /* check and deal with errors */
+  if (!res || PQresultStatus(res) > 2)
+  {
+    pg_log_error("query failed: %s", PQerrorMessage(conn));
+    PQclear(res);
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* cleanup */
+  destroyPQExpBuffer(array);
+
+  return res;
+}
+
+
+/*
+ * Tell if the blockers of a process need a new snapshot, on a sample with
+ * this wait event type
+ *
+ * pg_blocking_pids() needs to look at the lock manager, so the blockers are
+ * only looked for when the process starts waiting on a lock, and then at
+ * most every PGWAITEVENT_BLOCKERS_INTERVAL seconds while it keeps waiting.
+ * The samples in between go to the blockers of the last snapshot.
+ */
+bool
+blockers_need_snapshot(blockers *b, const char *type, double now)
+{
+  if (strcmp(type, "Lock") != 0)
+  {
+    b->waiting = false;
+    return false;
+  }
+
+  return !b->waiting || now - b->snapshot >= PGWAITEVENT_BLOCKERS_INTERVAL;
+}
+
+
+/*
+ * Take the blockers of a PID, starting at a row of a sample_blockers()
+ * result, as its current blockers, and move past them. With a NULL
+ * blockers, the rows are only skipped.
+ */
+void
+blockers_set_snapshot(blockers *b, PGresult *res, int pid, int *row, double now)
+{
+  int i;
+
+  if (b)
+    b->ncurrent = 0;
+  for (; *row < PQntuples(res) && atoi(PQgetvalue(res, *row, 0)) == pid; (*row)++)
+  {
+    int        bpid = atoi(PQgetvalue(res, *row, 1));
+    const char *queryid = PQgetvalue(res, *row, 3);
+
+    if (!b)
+      continue;
+
+    /* find the blocker, there are only a few of them */
+    for (i = 0; i < b->nblockers; i++)
+    {
+      if (b->blockers[i].pid == bpid && strcmp(b->blockers[i].queryid, queryid) == 0)
+        break;
+    }
+    if (i == b->nblockers)
+    {
+      if (b->nblockers == b->maxblockers)
+      {
+        b->maxblockers = b->maxblockers > 0 ? b->maxblockers * 2 : 8;
+        b->blockers = (blocker *) pg_realloc(b->blockers,
+          b->maxblockers * sizeof(blocker));
+      }
+      b->blockers[i].pid = bpid;
+      b->blockers[i].queryid = pg_strdup(queryid);
+      b->blockers[i].state = NULL;
+      b->blockers[i].samples = 0;
+      b->nblockers++;
+    }
+
+    /* its latest state */
+    pg_free(b->blockers[i].state);
+    b->blockers[i].state = pg_strdup(PQgetvalue(res, *row, 2));
+    if (b->ncurrent == b->maxcurrent)
+    {
+      b->maxcurrent = b->maxcurrent > 0 ? b->maxcurrent * 2 : 8;
+      b->current = (int *) pg_realloc(b->current, b->maxcurrent * sizeof(int));
+    }
+    b->current[b->ncurrent++] = i;
+  }
+  if (b)
+    b->snapshot = now;
+}
+
+
+/*
+ * Share a Lock wait sample between the current blockers of a process
+ */
+void
+blockers_share_sample(blockers *b)
+{
+  int i;
+
+  b->waiting = true;
+  b->nsamples++;
+  if (b->ncurrent == 0)
+    b->unknown++;
+  for (i = 0; i < b->ncurrent; i++)
+    b->blockers[b->current[i]].samples += 1. / b->ncurrent;
+}
+
+
+/*
+ * Record the wait event type of a process on a sample, and share its Lock
+ * waits between the processes blocking it
+ */
+void
+blockers_add_sample(blockers *b, int pid, const char *type, double now)
+{
+  PGresult *res;
+  int      row = 0;
+
+  if (blockers_need_snapshot(b, type, now))
+  {
+    res = sample_blockers(&pid, 1);
+    blockers_set_snapshot(b, res, pid, &row, now);
+    PQclear(res);
+  }
+  else if (!b->waiting)
+    return;
+
+  blockers_share_sample(b);
+}
+
+
+/*
+ * Order PIDs
+ */
+static int
+compare_pids(const void *a, const void *b)
+{
+  int pa = *(const int *) a;
+  int pb = *(const int *) b;
+
+  return pa < pb ? -1 : pa > pb ? 1 : 0;
+}
+
+
+/*
+ * Take a new snapshot of the blockers of the traced queries waiting on a
+ * lock, with one query for all of them, and share their sample
+ */
+void
+sample_all_blockers(inflights *t, int *pids, int npids, double now)
+{
+  PGresult *res;
+  inflight *e;
+  int      row = 0;
+  int      i;
+
+  /* the rows come sorted on the waiting PIDs */
+  qsort(pids, npids, sizeof(int), compare_pids);
+  res = sample_blockers(pids, npids);
+  for (i = 0; i < npids; i++)
+  {
+    e = inflight_lookup(t, pids[i]);
+    blockers_set_snapshot(e ? &e->blockers : NULL, res, pids[i], &row, now);
+    if (e)
+      blockers_share_sample(&e->blockers);
+  }
+  PQclear(res);
+}
+
+
+/*
+ * Order blockers by decreasing share of the Lock waits
+ */
+static int
+compare_blockers(const void *a, const void *b)
+{
+  const blocker *ba = (const blocker *) a;
+  const blocker *bb = (const blocker *) b;
+
+  if (ba->samples != bb->samples)
+    return ba->samples > bb->samples ? -1 : 1;
+  return ba->pid - bb->pid;
+}
+
+
+/*
+ * Print the blockers of the Lock waits, with their share of them
+ */
+void
+print_blockers(blockers *b)
+{
+  int i;
+
+  if (b->nsamples == 0)
+    return;
+
+  qsort(b->blockers, b->nblockers, sizeof(blocker), compare_blockers);
+
+  /* print headers */
+  (void)printf("Blockers of %ld Lock samples:\n", b->nsamples);
+  (void)printf(
+"┌─────────────┬──────────────────────┬───────────────────────────────┬──────────────┬─────────┐\n"
+"│ Blocker PID │ Query ID             │ State                         │ Lock samples │ Percent │\n"
+"├─────────────┼──────────────────────┼───────────────────────────────┼──────────────┼─────────┤\n");
+
+  for (i = 0; i < b->nblockers; i++)
+  {
+    (void)printf("│ %11d │ %20s │ %-29.29s │ %12.1f │  %6.2f │\n",
+      b->blockers[i].pid,
+      *b->blockers[i].queryid ? b->blockers[i].queryid : "-",
+      b->blockers[i].state,
+      b->blockers[i].samples,
+      b->blockers[i].samples * 100. / b->nsamples);
+  }
+  if (b->unknown > 0)
+  {
+    (void)printf("│ %11s │ %20s │ %-29.29s │ %12.1f │  %6.2f │\n",
+      "-", "-", "none found",
+      b->unknown,
+      b->unknown * 100. / b->nsamples);
+  }
+
+  /* print footers */
+  (void)printf(
+"└─────────────┴──────────────────────┴───────────────────────────────┴──────────────┴─────────┘\n");
+
+  /* the current snapshot refers to the blockers by their position */
+  b->ncurrent = 0;
+}
+
+
+/*
+ * Forget the blockers of a process
+ */
+void
+blockers_reset(blockers *b)
+{
+  int i;
+
+  for (i = 0; i < b->nblockers; i++)
+  {
+    pg_free(b->blockers[i].queryid);
+    pg_free(b->blockers[i].state);
+  }
+  pg_free(b->blockers);
+  pg_free(b->current);
+  memset(b, 0, sizeof(blockers));
+}
+
+
+/*
+ * Read the state and the CPU usage of a process in /proc/<pid>/stat and
+ * /proc/<pid>/schedstat, and its command name if asked to
+ */
+bool
+read_procstat(int pid, procstat *ps, char *comm, size_t commsize)
+{
+  char              path[MAXPGPATH];
+  char              buf[1024];
+  char              *fields[40];
+  char              *c;
+  FILE              *f;
+  size_t            len;
+  int               nfields = 0;
+  unsigned long long oncpu;
+  unsigned long long runqueue;
+  double            tick = sysconf(_SC_CLK_TCK);
+
+  /* read the status of the process */
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  if ((f = fopen(path, "r")) == NULL)
+    return false;
+  len = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[len] = '\0';
+
+  /* the command name is between parentheses, and may contain some */
+  c = strrchr(buf, ')');
+  if (c == NULL || strchr(buf, '(') == NULL)
+    return false;
+  if (comm)
+  {
+    *c = '\0';
+    strlcpy(comm, strchr(buf, '(') + 1, commsize);
+  }
+
+  /* the fields that follow it, the state being the third one */
+  for (c = strtok(c + 1, " "); c && nfields < lengthof(fields); c = strtok(NULL, " "))
+    fields[nfields++] = c;
+  if (nfields < lengthof(fields))
+    return false;
+  ps->state = fields[0][0];
+  ps->utime = atof(fields[11]) / tick;
+  ps->stime = atof(fields[12]) / tick;
+  ps->iowait = atof(fields[39]) / tick;
+
+  /* time on a CPU, and in the run queue, if the kernel has schedstats */
+  ps->oncpu = 0;
+  ps->runqueue = 0;
+  snprintf(path, sizeof(path), "/proc/%d/schedstat", pid);
+  if ((f = fopen(path, "r")) != NULL)
+  {
+    if (fscanf(f, "%llu %llu", &oncpu, &runqueue) == 2)
+    {
+      ps->oncpu = oncpu / 1e9;
+      ps->runqueue = runqueue / 1e9;
+    }
+    fclose(f);
+  }
+
+  return true;
+}
+
+
+/*
+ * Check that our own backend can be found in /proc, which means that we run
+ * on the server host, and see its processes
+ */
+void
+check_local()
+{
+  procstat ps;
+  char     comm[64];
+
+  if (!read_procstat(PQbackendPID(conn), &ps, comm, sizeof(comm)) ||
+      strncmp(comm, "postgres", 8) != 0)
+  {
+    pg_log_error("Cannot find our backend in /proc, -L only works on the server host.");
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+/*
+ * Read the CPU usage of a process on a sample, and tell apart the [Running]
+ * samples
+ *
+ * pg_stat_activity has no wait event for a backend using the CPU, but also
+ * for a backend waiting for a CPU, or sleeping in a system call that is not
+ * instrumented. The state of the process tells if it's running (or
+ * runnable), and its schedstat tells if it spent more time on a CPU or in
+ * the run queue since the previous sample.
+ */
+const char *
+local_event(cpustats *cs, int pid, const char *event)
+{
+  procstat ps;
+  bool     queued;
+
+  if (!read_procstat(pid, &ps, NULL, 0))
+    return event;
+
+  queued = cs->valid &&
+           ps.runqueue - cs->last.runqueue > ps.oncpu - cs->last.oncpu;
+  if (!cs->valid)
+    cs->first = ps;
+  cs->last = ps;
+  cs->valid = true;
+
+  if (strcmp(event, "[Running]") != 0)
+    return event;
+  if (ps.state != 'R')
+    return ps.state == 'D' ? "[Running] disk sleep" : "[Running] off CPU";
+  return queued ? "[Running] run queue" : "[Running] on CPU";
+}
+
+
+/*
+ * Print the CPU usage of a process while it executed a query
+ */
+void
+print_cpustats(cpustats *cs)
+{
+  if (!cs->valid)
+    return;
+
+  (void)printf("CPU: %.3fs user, %.3fs system, %.3fs in run queue, %.3fs I/O wait\n",
+    cs->last.utime - cs->first.utime,
+    cs->last.stime - cs->first.stime,
+    cs->last.runqueue - cs->first.runqueue,
+    cs->last.iowait - cs->first.iowait);
+}
+
+
+/*
+ * Print the profile of the query that just ended, and forget it
+ */
+void
+end_query(profile *p, parallelism *pl, timeline *tl, blockers *bl,
+          cpustats *cs, samplingstats *st)
+{
+  int i;
+
+  /* aggregate it by query_id, or show it */
+  if (opts->report_interval > 0)
+  {
+    add_query_profile(opts->queryid, opts->query, p);
+  }
+  else if (opts->output == OUTPUT_FOLDED)
+  {
+    print_folded(opts->queryid, p);
+  }
+  else if (opts->output == OUTPUT_TIMELINE)
+  {
+    /* the timelines are in the processes with -g */
+    if (opts->includeleaderworkers)
+    {
+      for (i = 0; i < pl->nprocesses; i++)
+        print_transitions(opts->queryid, pl->processes[i].pid, &pl->processes[i].timeline);
+    }
+    else
+      print_transitions(opts->queryid, opts->pid, tl);
+  }
+  else
+  {
+    /* show durations, and how well the query was sampled */
+    print_durations();
+    print_stats(st);
+    if (opts->local)
+      print_cpustats(cs);
+
+    /* show the parallelism, and the wait events of each process */
+    if (opts->includeleaderworkers)
+      print_parallelism(pl);
+
+    /* show the wait events */
+    print_profile(p);
+    if (opts->timeline && !opts->includeleaderworkers)
+      print_timeline(opts->pid, tl, p);
+
+    /* show who the PID waited for */
+    if (opts->blockers)
+      print_blockers(bl);
+  }
+
+  /* cleanup */
+  memset(cs, 0, sizeof(cpustats));
+  blockers_reset(bl);
+  timeline_reset(tl);
+  profile_reset(p);
+  parallelism_reset(pl);
+  pg_free(opts->query_start);
+  pg_free(opts->trace_start);
+  pg_free(opts->query);
+  pg_free(opts->queryid);
+}
+
+
+/*
+ * Sample the wait events of the PID from the client, and print a profile
+ * for each query it executes
+ *
+ * Nothing is written on the server: each sample is a single read of
+ * pg_stat_activity, and the wait events are counted in a local hash table.
+ */
+void
+trace_session()
+{
+  PGresult *res;
+  profile       current = {0, 0, 0, NULL};
+  parallelism   pl;
+  timeline      tl;
+  blockers      bl;
+  cpustats      cs;
+  samplingstats querystats;
+  double        querybegin = 0;
+  double        deadline;
+  double        begin;
+  double        end;
+  long          missed;
+  bool          tracing = false;
+  const char    *leaderevent;
+  int           leader;
+  int           row;
+
+  memset(&pl, 0, sizeof(parallelism));
+  memset(&tl, 0, sizeof(timeline));
+  memset(&bl, 0, sizeof(blockers));
+  memset(&cs, 0, sizeof(cpustats));
+  stats_reset(&runstats);
+  deadline = clock_now();
+
+  while (!stop_requested)
+  {
+    begin = clock_now();
+    res = sample_wait_events();
+    end = clock_now();
+    stats_add(&runstats, deadline, begin, end);
+
+    /* find the row of the PID, the other ones are its workers */
+    leader = -1;
+    for (row = 0; row < PQntuples(res); row++)
+    {
+      if (atoi(PQgetvalue(res, row, 0)) == opts->pid)
+        leader = row;
+    }
+
+    /* if there is no row for the PID, it's gone */
+    if (leader < 0)
+    {
+      PQclear(res);
+      if (tracing)
+        end_query(&current, &pl, &tl, &bl, &cs, &querystats);
+      report_top_queries(true);
+      if (opts->output == OUTPUT_TABLE)
+      {
+        printf("\nNo more session with PID %d, exiting...\n", opts->pid);
+        print_stats(&runstats);
+      }
+      PQfinish(conn);
+      exit(2);
+    }
+
+    /* the traced query ended, or another one started */
+    if (tracing &&
+        (strcmp(PQgetvalue(res, leader, 1), "active") != 0 ||
+         strcmp(PQgetvalue(res, leader, 2), opts->query_start) != 0))
+    {
+      end_query(&current, &pl, &tl, &bl, &cs, &querystats);
+      tracing = false;
+    }
+
+    /* a new query is executed */
+    if (!tracing && strcmp(PQgetvalue(res, leader, 1), "active") == 0)
+    {
+      if (opts->report_interval == 0 && opts->output == OUTPUT_TABLE)
+        printf("\nNew query: %s\n", PQgetvalue(res, leader, 4));
+      querybegin = begin;
+      opts->query_start = pg_strdup(PQgetvalue(res, leader, 2));
+      opts->trace_start = pg_strdup(PQgetvalue(res, leader, 3));
+      opts->query = pg_strdup(PQgetvalue(res, leader, 4));
+      opts->queryid = pg_strdup(PQgetvalue(res, leader, 7));
+      stats_reset(&querystats);
+      tracing = true;
+    }
+
+    /* count the wait events of every process */
+    if (tracing)
     {
-      pg_log_error("query failed: %s", PQerrorMessage(conn));
-      pg_log_info("query was: %s", sql);
-      PQclear(workers_res);
-      PQfinish(conn);
-      exit(EXIT_FAILURE);
+      leaderevent = PQgetvalue(res, leader, 5);
+      if (opts->local)
+        leaderevent = local_event(&cs, opts->pid, leaderevent);
+      for (row = 0; row < PQntuples(res); row++)
+        profile_add(&current, row == leader ? leaderevent : PQgetvalue(res, row, 5),
+          PQgetvalue(res, row, 6), 1);
+      if (opts->includeleaderworkers)
+        parallelism_add_sample(&pl, res, begin - querybegin, leaderevent);
+      else if (opts->timeline)
+        timeline_add(&tl, begin - querybegin, &current,
+          leaderevent, PQgetvalue(res, leader, 6));
+      if (opts->blockers)
+        blockers_add_sample(&bl, opts->pid, PQgetvalue(res, leader, 6), begin);
+      stats_add(&querystats, deadline, begin, end);
     }
 
-    /* get the number of leader and workers */
-    nworkers = atoi(PQgetvalue(workers_res, 0, 0));
+    /* cleanup */
+    PQclear(res);
 
-    /* clean up */
-    PQclear(workers_res);
+    /* show the top queries from time to time */
+    report_top_queries(false);
+
+    /* wait till the next sample */
+    deadline = wait_next_sample(deadline, &missed);
+    runstats.missed += missed;
+    if (tracing)
+      querystats.missed += missed;
   }
 
-  /* build the trace query */
-  snprintf(sql, sizeof(sql), "SELECT * FROM pgwaitevent.trace_wait_events_for_pid(%d, %s, %f);",
-    opts->pid, opts->includeleaderworkers ? "'t'" : "'f'", opts->interval);
+  /* interrupted, show what we got on the current query */
+  if (tracing)
+    end_query(&current, &pl, &tl, &bl, &cs, &querystats);
+  report_top_queries(true);
+  if (opts->output == OUTPUT_TABLE)
+    print_stats(&runstats);
+}
 
-  /* execute it */
-  trace_res = PQexec(conn, sql);
 
-  /* check and deal with errors */
-  if (!trace_res || PQresultStatus(trace_res) > 2)
+/*
+ * Allocate the table of traced queries
+ */
+void
+inflights_init(inflights *t, int max)
+{
+  int i;
+
+  t->count = 0;
+  t->max = max;
+  for (t->nbuckets = 16; t->nbuckets < max * 2; t->nbuckets *= 2)
+    ;
+  t->buckets = (inflight **) pg_malloc0(t->nbuckets * sizeof(inflight *));
+  t->pool = (inflight *) pg_malloc0(max * sizeof(inflight));
+  t->head = NULL;
+  t->tail = NULL;
+
+  /* every entry is free at first */
+  t->freelist = NULL;
+  for (i = max - 1; i >= 0; i--)
   {
-    pg_log_error("query failed: %s", PQerrorMessage(conn));
-    pg_log_info("query was: %s", sql);
-    PQclear(trace_res);
-    PQfinish(conn);
-    exit(EXIT_FAILURE);
+    t->pool[i].next = t->freelist;
+    t->freelist = &t->pool[i];
   }
+}
 
-  /* build the duration query */
-  snprintf(sql, sizeof(sql), "SELECT now()-'%s'::timestamptz, now()-'%s'::timestamptz;",
-    opts->query_start, opts->trace_start);
 
-  /* execute it */
-  duration_res = PQexec(conn, sql);
+/*
+ * Find the query traced for a PID
+ */
+inflight *
+inflight_lookup(inflights *t, int pid)
+{
+  inflight *e;
 
-  /* check and deal with errors */
-  if (!duration_res || PQresultStatus(duration_res) > 2)
+  for (e = t->buckets[pid & (t->nbuckets - 1)]; e != NULL; e = e->hnext)
   {
-    pg_log_error("query failed: %s", PQerrorMessage(conn));
-    pg_log_info("query was: %s", sql);
-    PQclear(duration_res);
-    PQfinish(conn);
-    exit(EXIT_FAILURE);
+    if (e->pid == pid)
+      return e;
   }
+  return NULL;
+}
 
-  /* show durations */
-  (void)printf("Query duration: %s\n", PQgetvalue(duration_res, 0, 0));
-  (void)printf("Trace duration: %s\n", PQgetvalue(duration_res, 0, 1));
 
-  /* show number of workers */
-  if (opts->includeleaderworkers)
-  {
-    (void)printf("Number of processes: %d\n", nworkers);
-  }
+/*
+ * Remove a query from the LRU list
+ */
+void
+inflight_unlink(inflights *t, inflight *e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    t->head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    t->tail = e->prev;
+  e->prev = NULL;
+  e->next = NULL;
+}
 
-  /* get the number of rows */
-  nrows = PQntuples(trace_res);
 
-  /* print headers */
-  (void)printf(
-"┌───────────────────────────────────┬───────────┬────────────┬─────────┐\n"
-"│ Wait event                        │ WE type   │ Occurences │ Percent │\n"
-"├───────────────────────────────────┼───────────┼────────────┼─────────┤\n");
+/*
+ * Move a query at the head of the LRU list
+ */
+void
+inflight_touch(inflights *t, inflight *e)
+{
+  if (t->head == e)
+    return;
+
+  inflight_unlink(t, e);
+  e->next = t->head;
+  if (t->head)
+    t->head->prev = e;
+  t->head = e;
+  if (t->tail == NULL)
+    t->tail = e;
+}
 
-  /* for each row, print all columns in a row */
-  for (row = 0; row < nrows; row++)
+
+/*
+ * Start tracing a new query, evicting the least recently sampled one if
+ * there are already too many queries traced
+ */
+inflight *
+inflight_add(inflights *t, int pid, const char *query_start,
+             const char *query, const char *queryid)
+{
+  inflight *e;
+  int      bucket = pid & (t->nbuckets - 1);
+
+  if (t->freelist == NULL)
+    end_inflight(t, t->tail, "evicted");
+
+  /* get a free entry */
+  e = t->freelist;
+  t->freelist = e->next;
+
+  memset(e, 0, sizeof(inflight));
+  e->pid = pid;
+  e->query_start = pg_strdup(query_start);
+  e->query = pg_strdup(query);
+  e->queryid = pg_strdup(queryid);
+
+  /* add it to its hash bucket, and at the head of the LRU list */
+  e->hnext = t->buckets[bucket];
+  t->buckets[bucket] = e;
+  e->next = t->head;
+  if (t->head)
+    t->head->prev = e;
+  t->head = e;
+  if (t->tail == NULL)
+    t->tail = e;
+  t->count++;
+
+  return e;
+}
+
+
+/*
+ * Print the profile of a traced query, and forget it
+ */
+void
+end_inflight(inflights *t, inflight *e, const char *why)
+{
+  inflight **link;
+
+  /* aggregate it by query_id, or show it */
+  if (opts->report_interval > 0)
   {
-    (void)printf("│ %-33s │ %-9s │ %10ld │  %6.2f │\n",
-      PQgetvalue(trace_res, row, 0),
-      PQgetvalue(trace_res, row, 1),
-      atol(PQgetvalue(trace_res, row, 2)),
-      atof(PQgetvalue(trace_res, row, 3))
-    );
+    add_query_profile(e->queryid, e->query, &e->profile);
+  }
+  else if (opts->output == OUTPUT_FOLDED)
+  {
+    print_folded(e->queryid, &e->profile);
+  }
+  else if (opts->output == OUTPUT_TIMELINE)
+  {
+    print_transitions(e->queryid, e->pid, &e->timeline);
+  }
+  else
+  {
+    /* show the query and its durations */
+    printf("\nPID %d, %s%s%squery %s: %s\n",
+      e->pid,
+      *e->queryid ? "query_id " : "",
+      e->queryid,
+      *e->queryid ? ", " : "",
+      why,
+      e->query);
+    (void)printf("Query duration: %.3fs\n", e->last_elapsed);
+    (void)printf("Trace duration: %.3fs\n", e->last_elapsed - e->first_elapsed);
+    (void)printf("Samples: %ld", e->nticks);
+    if (e->last_elapsed > e->first_elapsed)
+      (void)printf(", at %.1f per second", (e->nticks - 1) / (e->last_elapsed - e->first_elapsed));
+    (void)printf("\n");
+    if (opts->local)
+      print_cpustats(&e->cpu);
+    if (opts->includeleaderworkers)
+      (void)printf("Number of processes: %d at most\n", e->maxprocesses);
+
+    /* show the wait events */
+    print_profile(&e->profile);
+    if (opts->timeline)
+      print_timeline(e->pid, &e->timeline, &e->profile);
+    if (opts->blockers)
+      print_blockers(&e->blockers);
   }
 
-  /* print footers */
-  (void)printf(
-"└───────────────────────────────────┴───────────┴────────────┴─────────┘\n");
+  /* remove it from its hash bucket, and from the LRU list */
+  for (link = &t->buckets[e->pid & (t->nbuckets - 1)]; *link != e; link = &(*link)->hnext)
+    ;
+  *link = e->hnext;
+  inflight_unlink(t, e);
+  t->count--;
 
   /* cleanup */
-  PQclear(duration_res);
-  PQclear(trace_res);
+  blockers_reset(&e->blockers);
+  timeline_reset(&e->timeline);
+  profile_reset(&e->profile);
+  pg_free(e->query_start);
+  pg_free(e->query);
+  pg_free(e->queryid);
+  e->next = t->freelist;
+  t->freelist = e;
 }
 
 
 /*
- * Drop env
+ * Prepare the statement used to sample the wait events of all active
+ * backends
  */
 void
-drop_env()
+prepare_all_sampler()
 {
   char     sql[PGWAITEVENT_DEFAULT_STRING_SIZE];
   PGresult *res;
 
-  /* no need to drop the temp table */
-
-  /* drop function */
+  /* build the sampling query */
   snprintf(sql, sizeof(sql),
-    "DROP FUNCTION pgwaitevent.trace_wait_events_for_pid(integer, boolean, numeric)");
-
-  /* make the call */
-  res = PQexec(conn, sql);
+    "SELECT pid, query_start, extract(epoch FROM now()-query_start), query,\n"
+    "  COALESCE(wait_event, '[Running]'), COALESCE(wait_event_type, ''),\n"
+    "  %s, %s\n"
+    "FROM pg_stat_activity\n"
+    "WHERE (backend_type='client backend'%s) AND state='active'\n"
+    "AND pid<>pg_backend_pid()\n"
+    "ORDER BY backend_type<>'client backend'",
+    backend_minimum_version(14, 0) ? "COALESCE(query_id::text, '')" : "''",
+    opts->includeleaderworkers ? "CASE WHEN backend_type='parallel worker' THEN leader_pid END" : "NULL",
+    opts->includeleaderworkers ? " OR backend_type='parallel worker'" : "");
+
+  /* prepare it */
+  res = PQprepare(conn, "sample_all_wait_events", sql, 0, NULL);
 
   /* check and deal with errors */
-  if (!res || PQresultStatus(res) > 2)
+  if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
   {
     pg_log_error("query failed: %s", PQerrorMessage(conn));
     pg_log_info("query was: %s", sql);
@@ -668,33 +2745,369 @@ drop_env()
     exit(EXIT_FAILURE);
   }
 
-  /* print verbose */
-  if (opts->verbose)
-    printf("Function dropped\n");
-
-  /* drop function */
-  snprintf(sql, sizeof(sql),
-    "DROP SCHEMA pgwaitevent");
+  /* cleanup */
+  PQclear(res);
+}
 
-  /* make the call */
-  res = PQexec(conn, sql);
 
-  /* check and deal with errors */
-  if (!res || PQresultStatus(res) > 2)
+/*
+ * Sample the wait events of all active backends, and print a profile for
+ * each query once it ends
+ *
+ * A query is identified by its PID and its start time. Every sampled query
+ * goes at the head of an LRU list, so the queries left behind the sampled
+ * ones at the end of a sample are the ones that ended. The number of traced
+ * queries is bounded: when it is reached, the least recently sampled query
+ * is evicted, with the profile it got so far, unless it was already sampled
+ * this time; the new query is then left out of this sample.
+ */
+void
+trace_all_sessions()
+{
+  PGresult  *res;
+  inflights traced;
+  inflight  *e;
+  const char *event;
+  long      sample = 0;
+  double    deadline;
+  double    begin;
+  long      missed;
+  bool      warned = false;
+  int       *waiters = NULL;
+  int       nwaiters;
+  int       row;
+
+  inflights_init(&traced, opts->maxinflight);
+  stats_reset(&runstats);
+  deadline = clock_now();
+
+  while (!stop_requested)
   {
-    pg_log_error("query failed: %s", PQerrorMessage(conn));
-    pg_log_info("query was: %s", sql);
+    sample++;
+
+    /* execute the prepared statement */
+    begin = clock_now();
+    res = PQexecPrepared(conn, "sample_all_wait_events", 0, NULL, NULL, NULL, 0);
+    stats_add(&runstats, deadline, begin, clock_now());
+
+    /* check and deal with errors */
+    if (!res || PQresultStatus(res) > 2)
+    {
+      pg_log_error("query failed: %s", PQerrorMessage(conn));
+      PQclear(res);
+      PQfinish(conn);
+      exit(EXIT_FAILURE);
+    }
+
+    /* the queries whose blockers need a new snapshot */
+    waiters = (int *) pg_realloc(waiters, (PQntuples(res) + 1) * sizeof(int));
+    nwaiters = 0;
+
+    for (row = 0; row < PQntuples(res); row++)
+    {
+      int pid = atoi(PQgetvalue(res, row, 0));
+
+      /*
+       * a parallel worker counts for the query of its leader, which comes
+       * first in the sample
+       */
+      if (!PQgetisnull(res, row, 7))
+      {
+        e = inflight_lookup(&traced, atoi(PQgetvalue(res, row, 7)));
+        if (e && e->lastseen == sample)
+        {
+          profile_add(&e->profile, PQgetvalue(res, row, 4), PQgetvalue(res, row, 5), 1);
+          e->nprocesses++;
+          e->maxprocesses = Max(e->maxprocesses, e->nprocesses);
+        }
+        continue;
+      }
+
+      /* the PID started another query since the previous sample */
+      e = inflight_lookup(&traced, pid);
+      if (e && strcmp(e->query_start, PQgetvalue(res, row, 1)) != 0)
+      {
+        end_inflight(&traced, e, "ended");
+        e = NULL;
+      }
+
+      /* a new query */
+      if (e == NULL)
+      {
+        /*
+         * evicting a query sampled the previous time means that more queries
+         * than -m are running, so each one gets evicted and traced again as
+         * a new one, over and over
+         */
+        if (!warned && traced.freelist == NULL && traced.tail->lastseen >= sample - 1)
+        {
+          pg_log_warning("more than %d queries are active, their profiles are split on evictions, raise -m",
+                         opts->maxinflight);
+          warned = true;
+        }
+
+        /*
+         * the least recently sampled query was already sampled this time, so
+         * its parallel workers may still come in this sample: this query
+         * waits for an entry freed between samples
+         */
+        if (traced.freelist == NULL && traced.tail->lastseen == sample)
+          continue;
+
+        e = inflight_add(&traced, pid, PQgetvalue(res, row, 1),
+          PQgetvalue(res, row, 3), PQgetvalue(res, row, 6));
+        e->first_elapsed = atof(PQgetvalue(res, row, 2));
+      }
+
+      /* count its wait event */
+      event = PQgetvalue(res, row, 4);
+      if (opts->local)
+        event = local_event(&e->cpu, pid, event);
+      profile_add(&e->profile, event, PQgetvalue(res, row, 5), 1);
+      e->last_elapsed = atof(PQgetvalue(res, row, 2));
+      if (opts->timeline)
+        timeline_add(&e->timeline, e->last_elapsed - e->first_elapsed, &e->profile,
+          event, PQgetvalue(res, row, 5));
+      if (opts->blockers)
+      {
+        if (blockers_need_snapshot(&e->blockers, PQgetvalue(res, row, 5), begin))
+          waiters[nwaiters++] = pid;
+        else if (e->blockers.waiting)
+          blockers_share_sample(&e->blockers);
+      }
+      e->lastseen = sample;
+      e->nticks++;
+      e->nprocesses = 1;
+      e->maxprocesses = Max(e->maxprocesses, 1);
+      inflight_touch(&traced, e);
+    }
+
+    /* the blockers of all the queries starting to wait, at once */
+    if (nwaiters > 0)
+      sample_all_blockers(&traced, waiters, nwaiters, begin);
+
+    /* the queries that were not sampled this time ended */
+    while (traced.tail && traced.tail->lastseen < sample)
+      end_inflight(&traced, traced.tail, "ended");
+
+    /* cleanup */
     PQclear(res);
-    PQfinish(conn);
-    exit(EXIT_FAILURE);
+
+    /* show the top queries from time to time */
+    report_top_queries(false);
+
+    /* wait till the next sample */
+    deadline = wait_next_sample(deadline, &missed);
+    runstats.missed += missed;
   }
 
-  /* print verbose */
-  if (opts->verbose)
-    printf("Schema dropped\n");
+  /* interrupted, show what we got on the running queries */
+  pg_free(waiters);
+  while (traced.tail)
+    end_inflight(&traced, traced.tail, "still running");
+  report_top_queries(true);
+  if (opts->output == OUTPUT_TABLE)
+    print_stats(&runstats);
+}
+
+
+/*
+ * Find the slot of a query_id in the query profiles, or the empty slot
+ * where it should go
+ */
+int
+queryprofiles_slot(queryprofiles *t, const char *queryid)
+{
+  uint32     hash = 2166136261u;
+  const char *c;
+  int        slot;
+
+  /* FNV-1a hash of the query_id */
+  for (c = queryid; *c; c++)
+    hash = (hash ^ (unsigned char) *c) * 16777619u;
+
+  /* linear probing, the size being a power of two */
+  slot = hash & (t->size - 1);
+  while (t->entries[slot].queryid != NULL &&
+         strcmp(t->entries[slot].queryid, queryid) != 0)
+    slot = (slot + 1) & (t->size - 1);
+
+  return slot;
+}
+
+
+/*
+ * Add the profile of one execution of a query to the profile of its query_id
+ *
+ * Queries without a query_id (utility statements, or compute_query_id
+ * disabled) all go to the same empty query_id.
+ */
+void
+add_query_profile(const char *queryid, const char *query, profile *p)
+{
+  queryprofile *qp;
+  int          i;
+
+  /* grow the hash table when it is half full */
+  if (queries.nentries * 2 >= queries.size)
+  {
+    queryprofile *old = queries.entries;
+    int          oldsize = queries.size;
+
+    queries.size = oldsize > 0 ? oldsize * 2 : PGWAITEVENT_PROFILE_SIZE;
+    queries.entries = (queryprofile *) pg_malloc0(queries.size * sizeof(queryprofile));
+    for (i = 0; i < oldsize; i++)
+    {
+      if (old[i].queryid != NULL)
+        queries.entries[queryprofiles_slot(&queries, old[i].queryid)] = old[i];
+    }
+    pg_free(old);
+  }
+
+  qp = &queries.entries[queryprofiles_slot(&queries, queryid)];
+  if (qp->queryid == NULL)
+  {
+    qp->queryid = pg_strdup(queryid);
+    qp->query = pg_strdup(query);
+    queries.nentries++;
+  }
+  qp->executions++;
+  profile_merge(&qp->profile, p);
+}
+
+
+/*
+ * Order query profiles by decreasing number of samples
+ */
+static int
+compare_queryprofiles(const void *a, const void *b)
+{
+  const queryprofile *qa = *(const queryprofile * const *) a;
+  const queryprofile *qb = *(const queryprofile * const *) b;
+
+  if (qa->profile.nsamples != qb->profile.nsamples)
+    return qa->profile.nsamples > qb->profile.nsamples ? -1 : 1;
+  return strcmp(qa->queryid, qb->queryid);
+}
+
+
+/*
+ * Print the queries with the most samples, with their main wait events
+ */
+void
+print_top_queries()
+{
+  queryprofile **sorted;
+  int          nsorted = 0;
+  int          i;
+  int          j;
+
+  /* sort the query profiles */
+  sorted = (queryprofile **) pg_malloc((queries.nentries + 1) * sizeof(queryprofile *));
+  for (i = 0; i < queries.size; i++)
+  {
+    if (queries.entries[i].queryid != NULL)
+      sorted[nsorted++] = &queries.entries[i];
+  }
+  qsort(sorted, nsorted, sizeof(queryprofile *), compare_queryprofiles);
+
+  /* print headers */
+  (void)printf("\nTop queries:\n");
+  (void)printf(
+"┌──────────────────────┬────────────┬───────────┬──────────────────────────────────────────┬──────────────────────────────────────────┐\n"
+"│ Query ID             │ Executions │ Samples   │ Top wait events                          │ Query                                    │\n"
+"├──────────────────────┼────────────┼───────────┼──────────────────────────────────────────┼──────────────────────────────────────────┤\n");
+
+  for (i = 0; i < nsorted && i < opts->top; i++)
+  {
+    queryprofile *qp = sorted[i];
+    waitevent    *events;
+    char         waits[PGWAITEVENT_DEFAULT_STRING_SIZE];
+    char         query[41];
+    size_t       len = 0;
+
+    /* the three most frequent wait events, with their share */
+    waits[0] = '\0';
+    events = profile_sorted(&qp->profile);
+    for (j = 0; j < qp->profile.nentries && j < 3; j++)
+    {
+      len += snprintf(waits + len, sizeof(waits) - len, "%s%s%s%s %.0f%%",
+        j > 0 ? ", " : "",
+        events[j].type,
+        *events[j].type ? ":" : "",
+        events[j].event,
+        events[j].occurences * 100. / qp->profile.nsamples);
+      if (len >= sizeof(waits))
+        break;
+    }
+    pg_free(events);
+
+    /* the beginning of the query, on a single line */
+    strlcpy(query, qp->query, sizeof(query));
+    for (j = 0; query[j]; j++)
+    {
+      if (query[j] == '\n' || query[j] == '\r' || query[j] == '\t')
+        query[j] = ' ';
+    }
+
+    (void)printf("│ %20s │ %10ld │ %9ld │ %-40.40s │ %-40.40s │\n",
+      *qp->queryid ? qp->queryid : "-",
+      qp->executions,
+      qp->profile.nsamples,
+      waits,
+      query);
+  }
+
+  /* print footers */
+  (void)printf(
+"└──────────────────────┴────────────┴───────────┴──────────────────────────────────────────┴──────────────────────────────────────────┘\n");
 
   /* cleanup */
-  PQclear(res);
+  pg_free(sorted);
+}
+
+
+/*
+ * Print the profiles of all the queries as folded stacks
+ */
+void
+print_folded_queries()
+{
+  int i;
+
+  for (i = 0; i < queries.size; i++)
+  {
+    if (queries.entries[i].queryid != NULL)
+      print_folded(queries.entries[i].queryid, &queries.entries[i].profile);
+  }
+}
+
+
+/*
+ * Print the top queries if it's time to do so (or if forced)
+ */
+void
+report_top_queries(bool force)
+{
+  time_t now;
+
+  if (opts->report_interval == 0)
+    return;
+
+  /* folded stacks are only printed once, for the whole run */
+  if (opts->output == OUTPUT_FOLDED)
+  {
+    if (force)
+      print_folded_queries();
+    return;
+  }
+
+  now = time(NULL);
+  if (!force && now < next_report)
+    return;
+
+  print_top_queries();
+  next_report = now + opts->report_interval;
 }
 
 
@@ -739,6 +3152,13 @@ main(int argc, char **argv)
   /* Fetch version */
   fetch_version();
 
+  /* Make sure nothing is written, unless needed */
+  setup_session();
+
+  /* Make sure we can read the backends in /proc */
+  if (opts->local)
+    check_local();
+
   /* Check options */
   if (opts->includeleaderworkers && !backend_minimum_version(13, 0))
   {
@@ -746,14 +3166,46 @@ main(int argc, char **argv)
     exit(EXIT_FAILURE);
   }
 
-  /* Create the trace_wait_events_for_pid function */
-  build_env();
+  /* Aggregating by query_id needs the query_id */
+  if (opts->report_interval > 0 && !backend_minimum_version(14, 0))
+  {
+    pg_log_error("You need at least v14 to aggregate wait events by query_id.");
+    exit(EXIT_FAILURE);
+  }
+  next_report = time(NULL) + opts->report_interval;
 
   /* show what we're doing */
-  printf("Tracing wait events for PID %d, sampling at %.3fs, %s\n",
-    opts->pid,
-    opts->interval,
-    opts->includeleaderworkers ? "including leader and workers" : "PID only");
+  if (opts->allbackends)
+  {
+    if (opts->output == OUTPUT_TABLE)
+      printf("Tracing wait events for all active backends, sampling at %.3fs\n",
+        opts->interval);
+    prepare_all_sampler();
+    if (opts->blockers)
+      prepare_blockers_sampler();
+    trace_all_sessions();
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+  if (opts->output == OUTPUT_TABLE)
+    printf("Tracing wait events for PID %d, sampling at %.3fs, %s\n",
+      opts->pid,
+      opts->interval,
+      opts->includeleaderworkers ? "including leader and workers" : "PID only");
+
+  /* Sample from the client, without writing anything on the server */
+  if (!opts->serverside)
+  {
+    prepare_sampler();
+    if (opts->blockers)
+      prepare_blockers_sampler();
+    trace_session();
+    PQfinish(conn);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Create the trace_wait_events_for_pid function */
+  build_env();
 
   while(true)
   {